@@ -0,0 +1,106 @@
+#ifndef BLOCKBUFFER_HPP
+#define BLOCKBUFFER_HPP
+
+#include <memory>
+#include <string>
+#include <string.h>
+
+#include "rpc/config.h"
+#include "rpc/msgpack.hpp"
+#include "BlockCodec.hpp"
+
+using namespace std;
+
+/** Block payloads: the bytes of an immutable refcounted buffer from offset
+ * on. Copying a BlockRef only shares the buffer, so a block received by an
+ * RPC is stored in hdm, queued for the next server of its chain and sent
+ * back by get_block / get_encoded_block without copying its bytes again.
+ *
+ * BlockRefs go over the wire as msgpack bin. Packing one into a reply
+ * points the msgpack object right into the buffer, which stays alive
+ * through a finalizer of the reply's zone until rpclib has written the
+ * reply out. Unpacking one (from bin, or from str as sent by older
+ * clients) copies the bytes once, into a fresh buffer behind a CODEC_NONE
+ * tag: a raw block received is then also its CODEC_NONE encoding, from
+ * encoded() on. Clients read bin and str alike into a string.
+ */
+struct BlockRef
+{
+    shared_ptr<const string> buf; // null: empty
+    size_t offset;
+
+    BlockRef() : offset(0) {}
+    BlockRef(const shared_ptr<const string>& t_buf, size_t t_offset = 0)
+        : buf(t_buf), offset(t_offset) {}
+    explicit BlockRef(string&& bytes)
+        : buf(make_shared<const string>(move(bytes))), offset(0) {}
+
+    const char* data() const { return buf ? buf->data() + offset : nullptr; }
+    size_t size() const { return buf ? buf->size() - offset : 0; }
+    bool empty() const { return size() == 0; }
+
+    // the same bytes without their first n
+    BlockRef tail(size_t n) const { return BlockRef(buf, offset + n); }
+
+    // a received raw block, CODEC_NONE encoded, without copying it
+    BlockRef encoded() const
+    {
+        if (offset > 0 && (uint8_t) (*buf)[offset - 1] == CODEC_NONE) { return BlockRef(buf, offset - 1); }
+        string enc(1, (char) CODEC_NONE);
+        enc.append(data(), size());
+        return BlockRef(move(enc));
+    }
+};
+
+namespace RPCLIB_MSGPACK {
+MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) {
+namespace adaptor {
+
+template <>
+struct convert<BlockRef> {
+    const RPCLIB_MSGPACK::object& operator()(const RPCLIB_MSGPACK::object& o, BlockRef& v) const {
+        const char* ptr;
+        uint32_t size;
+        if (o.type == RPCLIB_MSGPACK::type::BIN) {
+            ptr = o.via.bin.ptr;
+            size = o.via.bin.size;
+        } else if (o.type == RPCLIB_MSGPACK::type::STR) {
+            ptr = o.via.str.ptr;
+            size = o.via.str.size;
+        } else {
+            throw RPCLIB_MSGPACK::type_error();
+        }
+        string bytes(1 + (size_t) size, (char) CODEC_NONE);
+        if (size > 0) { memcpy(&bytes[1], ptr, size); }
+        v = BlockRef(make_shared<const string>(move(bytes)), 1);
+        return o;
+    }
+};
+
+template <>
+struct object_with_zone<BlockRef> {
+    static void release(void* buf) { delete static_cast<shared_ptr<const string>*>(buf); }
+
+    void operator()(RPCLIB_MSGPACK::object::with_zone& o, const BlockRef& v) const {
+        o.type = RPCLIB_MSGPACK::type::BIN;
+        o.via.bin.ptr = v.data();
+        o.via.bin.size = (uint32_t) v.size();
+        if (v.buf) { o.zone.push_finalizer(&release, new shared_ptr<const string>(v.buf)); }
+    }
+};
+
+template <>
+struct pack<BlockRef> {
+    template <typename Stream>
+    RPCLIB_MSGPACK::packer<Stream>& operator()(RPCLIB_MSGPACK::packer<Stream>& o, const BlockRef& v) const {
+        o.pack_bin((uint32_t) v.size());
+        o.pack_bin_body(v.data(), (uint32_t) v.size());
+        return o;
+    }
+};
+
+} // namespace adaptor
+} // MSGPACK_API_VERSION_NAMESPACE
+} // namespace RPCLIB_MSGPACK
+
+#endif // BLOCKBUFFER_HPP
@@ -0,0 +1,233 @@
+#include <string.h>
+#include <math.h>
+#include <vector>
+
+#include "BlockCodec.hpp"
+
+using namespace std;
+
+// blocks smaller than this are never worth compressing
+static const size_t MIN_COMPRESS_SIZE = 64;
+
+// bytes sampled by the entropy check
+static const size_t ENTROPY_SAMPLE = 4096;
+
+// above this many bits of entropy per byte the data is treated as already
+// compressed (media, archives, encrypted content) and stored raw
+static const double MAX_COMPRESSIBLE_ENTROPY = 7.2;
+
+static const size_t MIN_MATCH = 4;
+static const size_t MAX_OFFSET = 65535;
+static const int HASH_BITS = 12;
+
+list<int> supported_codecs()
+{
+    return { CODEC_NONE, CODEC_LZ };
+}
+
+// Shannon entropy (bits per byte) of the first ENTROPY_SAMPLE bytes
+static double sample_entropy(const string& raw)
+{
+    size_t n = raw.size() < ENTROPY_SAMPLE ? raw.size() : ENTROPY_SAMPLE;
+    size_t counts[256] = { 0 };
+    for (size_t i = 0; i < n; i++) {
+        counts[(unsigned char) raw[i]]++;
+    }
+    double h = 0.0;
+    for (size_t c : counts) {
+        if (c == 0) { continue; }
+        double p = (double) c / n;
+        h -= p * log2(p);
+    }
+    return h;
+}
+
+static void put_varint(string& out, uint64_t v)
+{
+    while (v >= 0x80) {
+        out.push_back((char) ((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+    out.push_back((char) v);
+}
+
+static bool get_varint(const unsigned char*& p, const unsigned char* end, uint64_t& v)
+{
+    v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        unsigned char b = *p++;
+        v |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) { return true; }
+    }
+    return false;
+}
+
+static inline uint32_t read32(const unsigned char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t hash32(uint32_t v)
+{
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+// lengths of 15 or more spill into a run of 255-valued bytes
+static void put_length(string& out, size_t len)
+{
+    while (len >= 255) {
+        out.push_back((char) 255);
+        len -= 255;
+    }
+    out.push_back((char) len);
+}
+
+static void put_sequence(string& out, const unsigned char* lit, size_t litlen,
+                         size_t offset, size_t matchlen)
+{
+    size_t mcode = matchlen ? matchlen - MIN_MATCH : 0;
+    unsigned char token = (unsigned char) (((litlen < 15 ? litlen : 15) << 4) |
+                                           (mcode < 15 ? mcode : 15));
+    out.push_back((char) token);
+    if (litlen >= 15) { put_length(out, litlen - 15); }
+    out.append((const char*) lit, litlen);
+    if (matchlen == 0) { return; } // final literal-only sequence
+    out.push_back((char) (offset & 0xff));
+    out.push_back((char) (offset >> 8));
+    if (mcode >= 15) { put_length(out, mcode - 15); }
+}
+
+// Greedy single-pass LZ77 with a 4096-entry hash table of 4-byte prefixes
+static void lz_compress(const string& raw, string& out)
+{
+    const unsigned char* base = (const unsigned char*) raw.data();
+    size_t n = raw.size();
+    vector<uint32_t> table(1 << HASH_BITS, 0); // position + 1, 0 = empty
+
+    size_t anchor = 0;
+    size_t ip = 0;
+    while (ip + MIN_MATCH <= n) {
+        uint32_t seq = read32(base + ip);
+        uint32_t h = hash32(seq);
+        size_t ref = table[h];
+        table[h] = (uint32_t) ip + 1;
+
+        if (ref == 0 || ip - (ref - 1) > MAX_OFFSET || read32(base + ref - 1) != seq) {
+            // skip faster through stretches that do not match
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        ref -= 1;
+
+        size_t len = MIN_MATCH;
+        while (ip + len < n && base[ref + len] == base[ip + len]) { len++; }
+
+        put_sequence(out, base + anchor, ip - anchor, ip - ref, len);
+        ip += len;
+        anchor = ip;
+    }
+    put_sequence(out, base + anchor, n - anchor, 0, 0);
+}
+
+static bool get_length(const unsigned char*& p, const unsigned char* end, size_t& len)
+{
+    unsigned char b;
+    do {
+        if (p >= end) { return false; }
+        b = *p++;
+        len += b;
+    } while (b == 255);
+    return true;
+}
+
+static bool lz_decompress(const unsigned char* p, const unsigned char* end,
+                          size_t rawlen, string& raw)
+{
+    raw.assign(rawlen, '\0');
+    unsigned char* out = rawlen ? (unsigned char*) &raw[0] : nullptr;
+    size_t op = 0;
+
+    while (p < end) {
+        unsigned char token = *p++;
+        size_t litlen = token >> 4;
+        if (litlen == 15 && !get_length(p, end, litlen)) { return false; }
+        if (litlen > (size_t) (end - p) || litlen > rawlen - op) { return false; }
+        if (litlen) { memcpy(out + op, p, litlen); }
+        p += litlen;
+        op += litlen;
+        if (p == end) { break; } // final literal-only sequence
+
+        if (end - p < 2) { return false; }
+        size_t offset = p[0] | (p[1] << 8);
+        p += 2;
+        size_t matchlen = token & 0x0f;
+        if (matchlen == 15 && !get_length(p, end, matchlen)) { return false; }
+        matchlen += MIN_MATCH;
+        if (offset == 0 || offset > op || matchlen > rawlen - op) { return false; }
+        // byte-wise: source and destination may overlap for short offsets
+        for (size_t i = 0; i < matchlen; i++, op++) {
+            out[op] = out[op - offset];
+        }
+    }
+    return op == rawlen;
+}
+
+string encode_block(const string& raw, int codec)
+{
+    string out;
+    if (codec == CODEC_LZ && raw.size() >= MIN_COMPRESS_SIZE &&
+        sample_entropy(raw) <= MAX_COMPRESSIBLE_ENTROPY) {
+        out.reserve(raw.size() / 2 + 16);
+        out.push_back((char) CODEC_LZ);
+        put_varint(out, raw.size());
+        lz_compress(raw, out);
+        if (out.size() < raw.size() + 1) { return out; }
+        out.clear();
+    }
+    out.reserve(raw.size() + 1);
+    out.push_back((char) CODEC_NONE);
+    out.append(raw);
+    return out;
+}
+
+bool decode_block(const char* encoded, size_t size, string& raw)
+{
+    if (size == 0) { return false; }
+    const unsigned char* p = (const unsigned char*) encoded;
+    const unsigned char* end = p + size;
+
+    switch (*p++) {
+    case CODEC_NONE:
+        raw.assign((const char*) p, end - p);
+        return true;
+    case CODEC_LZ: {
+        uint64_t rawlen;
+        if (!get_varint(p, end, rawlen)) { return false; }
+        // each payload byte expands to at most 255 raw bytes; reject
+        // headers that would make us allocate far more than that
+        if (rawlen > (uint64_t) (end - p) * 256 + 64) { return false; }
+        return lz_decompress(p, end, (size_t) rawlen, raw);
+    }
+    default:
+        return false;
+    }
+}
+
+bool valid_encoded_block(const char* encoded, size_t size)
+{
+    if (size == 0) { return false; }
+    const unsigned char* p = (const unsigned char*) encoded;
+    const unsigned char* end = p + size;
+    uint64_t rawlen;
+
+    switch (*p++) {
+    case CODEC_NONE:
+        return true;
+    case CODEC_LZ:
+        return get_varint(p, end, rawlen);
+    default:
+        return false;
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef BLOCKCODEC_HPP
+#define BLOCKCODEC_HPP
+
+#include <string>
+#include <list>
+#include <stdint.h>
+
+using namespace std;
+
+/** Per-block compression.
+ * An encoded block is a one byte codec tag followed by the codec payload:
+ *   CODEC_NONE: the raw block bytes
+ *   CODEC_LZ:   varint(raw length) + LZ77 sequences (LZ4-style token format)
+ * The server stores encoded blocks as-is, so compressed blocks also shrink
+ * the server's memory footprint. Hashes are always computed over the raw
+ * block, so the codec never changes a block's identity.
+ */
+enum BlockCodecTag : uint8_t {
+    CODEC_NONE = 0,
+    CODEC_LZ = 1,
+};
+
+// codec tags understood by this build, as advertised by get_codecs()
+list<int> supported_codecs();
+
+// Encode a raw block with the given codec. Blocks that look incompressible
+// (high byte entropy) or that do not shrink are stored as CODEC_NONE.
+string encode_block(const string& raw, int codec);
+
+// Decode an encoded block into raw; returns false on an unknown tag or a
+// corrupt payload
+bool decode_block(const char* encoded, size_t size, string& raw);
+inline bool decode_block(const string& encoded, string& raw)
+{
+    return decode_block(encoded.data(), encoded.size(), raw);
+}
+
+// Cheap sanity check used by the server before accepting an encoded block
+bool valid_encoded_block(const char* encoded, size_t size);
+inline bool valid_encoded_block(const string& encoded)
+{
+    return valid_encoded_block(encoded.data(), encoded.size());
+}
+
+#endif // BLOCKCODEC_HPP
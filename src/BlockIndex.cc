@@ -0,0 +1,182 @@
+#include "BlockIndex.hpp"
+#include "EpochGC.hpp"
+
+using namespace std;
+
+static const size_t INITIAL_BUCKETS = 1024;
+
+BlockIndex::Table::Table(size_t n)
+    : mask(n - 1), buckets(new atomic<Entry*>[n])
+{
+    for (size_t i = 0; i < n; i++) { buckets[i].store(nullptr, memory_order_relaxed); }
+}
+
+BlockIndex::Table::~Table()
+{
+    delete[] buckets;
+}
+
+BlockIndex::BlockIndex()
+    : table(new Table(INITIAL_BUCKETS)), filter(new CuckooFilter(INITIAL_BUCKETS / 2)), count(0), total_bytes(0),
+      changes(1)
+{
+}
+
+BlockIndex::~BlockIndex()
+{
+    free_table(table.load(), true);
+    delete filter.load();
+}
+
+// a table, with its entries if they are not linked into a newer one
+void BlockIndex::free_table(Table* t, bool entries)
+{
+    if (entries) {
+        for (size_t i = 0; i <= t->mask; i++) {
+            Entry* e = t->buckets[i].load(memory_order_relaxed);
+            while (e) {
+                Entry* next = e->next.load(memory_order_relaxed);
+                delete e;
+                e = next;
+            }
+        }
+    }
+    delete t;
+}
+
+// caller is inside an EpochGC::Guard
+const BlockIndex::Entry* BlockIndex::lookup(const string& hash) const
+{
+    uint64_t h = CuckooFilter::key_hash(hash);
+    // an entry's fingerprint is in the filter before the entry is linked,
+    // and stays there until it is unlinked
+    if (!filter.load(memory_order_acquire)->maybe_contains(h)) { return nullptr; }
+
+    const Table* t = table.load(memory_order_acquire);
+    for (const Entry* e = t->bucket(h).load(memory_order_acquire); e; e = e->next.load(memory_order_acquire)) {
+        if (e->hash == hash) { return e; }
+    }
+    return nullptr;
+}
+
+bool BlockIndex::find(const string& hash, BlockRef& block) const
+{
+    EpochGC::Guard guard;
+    const Entry* e = lookup(hash);
+    if (!e) { return false; }
+    block = e->block;
+    return true;
+}
+
+bool BlockIndex::contains(const string& hash) const
+{
+    EpochGC::Guard guard;
+    return lookup(hash) != nullptr;
+}
+
+size_t BlockIndex::filter_bytes() const
+{
+    EpochGC::Guard guard;
+    return filter.load(memory_order_acquire)->bytes();
+}
+
+bool BlockIndex::insert(const string& hash, const BlockRef& block)
+{
+    lock_guard<mutex> lock(mtx);
+    if (!hashes.insert(hash).second) { return false; }
+    if (count.load(memory_order_relaxed) >= table.load(memory_order_relaxed)->mask + 1) { grow(); }
+
+    uint64_t h = CuckooFilter::key_hash(hash);
+    while (!filter.load(memory_order_relaxed)->insert(h)) {
+        rebuild_filter(2 * filter.load(memory_order_relaxed)->bucket_count());
+    }
+    // fully built before readers can reach it
+    atomic<Entry*>& head = table.load(memory_order_relaxed)->bucket(h);
+    head.store(new Entry(hash, h, block, head.load(memory_order_relaxed)), memory_order_release);
+    count.fetch_add(1, memory_order_relaxed);
+    total_bytes.fetch_add(block.size(), memory_order_relaxed);
+    changes.fetch_add(1, memory_order_relaxed);
+    return true;
+}
+
+bool BlockIndex::erase(const string& hash)
+{
+    lock_guard<mutex> lock(mtx);
+    if (hashes.erase(hash) == 0) { return false; }
+
+    atomic<Entry*>* link = &table.load(memory_order_relaxed)->bucket(CuckooFilter::key_hash(hash));
+    Entry* e = link->load(memory_order_relaxed);
+    while (e->hash != hash) {
+        link = &e->next;
+        e = link->load(memory_order_relaxed);
+    }
+    // readers at e keep going through its (unchanged) next pointer
+    link->store(e->next.load(memory_order_relaxed), memory_order_release);
+    filter.load(memory_order_relaxed)->erase(e->h);
+    count.fetch_sub(1, memory_order_relaxed);
+    total_bytes.fetch_sub(e->block.size(), memory_order_relaxed);
+    changes.fetch_add(1, memory_order_relaxed);
+    EpochGC::instance().retire([e]() { delete e; });
+    return true;
+}
+
+// Double the buckets. Entries are linked into one chain only, so the new
+// table gets copies (sharing the blocks) and the old one is retired whole;
+// the filter grows along. Caller holds mtx.
+void BlockIndex::grow()
+{
+    Table* old = table.load(memory_order_relaxed);
+    Table* t = new Table(2 * (old->mask + 1));
+    for (size_t i = 0; i <= old->mask; i++) {
+        for (Entry* e = old->buckets[i].load(memory_order_relaxed); e; e = e->next.load(memory_order_relaxed)) {
+            atomic<Entry*>& head = t->bucket(e->h);
+            head.store(new Entry(e->hash, e->h, e->block, head.load(memory_order_relaxed)), memory_order_relaxed);
+        }
+    }
+    table.store(t, memory_order_release);
+    EpochGC::instance().retire([old]() { free_table(old, true); });
+    rebuild_filter((t->mask + 1) / 2);
+}
+
+// Replace the filter with one of at least `buckets` buckets holding every
+// linked entry. Readers still using the old one find every entry in it.
+// Caller holds mtx.
+void BlockIndex::rebuild_filter(size_t buckets)
+{
+    const Table* t = table.load(memory_order_relaxed);
+    CuckooFilter* f = nullptr;
+    while (!f) {
+        f = new CuckooFilter(buckets);
+        for (size_t i = 0; i <= t->mask && f; i++) {
+            for (Entry* e = t->buckets[i].load(memory_order_relaxed); e && f; e = e->next.load(memory_order_relaxed)) {
+                if (!f->insert(e->h)) {
+                    delete f;
+                    f = nullptr;
+                }
+            }
+        }
+        buckets *= 2;
+    }
+    CuckooFilter* old = filter.load(memory_order_relaxed);
+    filter.store(f, memory_order_release);
+    EpochGC::instance().retire([old]() { delete old; });
+}
+
+list<string> BlockIndex::list_after(const string& after, size_t limit)
+{
+    lock_guard<mutex> lock(mtx);
+    list<string> ret;
+    for (auto it = hashes.upper_bound(after); it != hashes.end() && ret.size() < limit; ++it) {
+        ret.push_back(*it);
+    }
+    return ret;
+}
+
+// under the writers' lock: a fingerprint half way through a move would
+// read as missing
+string BlockIndex::export_filter(uint64_t& at_version)
+{
+    lock_guard<mutex> lock(mtx);
+    at_version = changes.load(memory_order_relaxed);
+    return filter.load(memory_order_relaxed)->to_words();
+}
@@ -0,0 +1,91 @@
+#ifndef BLOCKINDEX_HPP
+#define BLOCKINDEX_HPP
+
+#include <atomic>
+#include <list>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "BlockBuffer.hpp"
+#include "CuckooFilter.hpp"
+
+using namespace std;
+
+/** The block store of a server: hash -> encoded block.
+ * Lookups (find, contains) take no lock and write no shared memory besides
+ * the refcount of the block they return: a chained hash table whose
+ * entries never change once linked, read under an EpochGC::Guard. Writers
+ * serialize on a mutex; erase() unlinks an entry and growing the table
+ * publishes a new one, and the entries and tables readers might still be
+ * walking are retired to EpochGC instead of freed.
+ * A cuckoo filter of the stored hashes is asked first, so most lookups of
+ * blocks that are not here (new content, the common case when uploading)
+ * end after two word reads without touching the table. It is rebuilt with
+ * the table, at most half full.
+ */
+class BlockIndex
+{
+  public:
+    BlockIndex();
+    ~BlockIndex();
+
+    // lock-free
+    bool find(const string& hash, BlockRef& block) const;
+    bool contains(const string& hash) const;
+    size_t size() const { return count.load(memory_order_relaxed); }
+    size_t bytes() const { return total_bytes.load(memory_order_relaxed); }
+    size_t filter_bytes() const;
+    // changes so far (inserts and erases), starting at 1
+    uint64_t version() const { return changes.load(memory_order_relaxed); }
+
+    // false if the hash is stored already
+    bool insert(const string& hash, const BlockRef& block);
+    // false if the hash is not stored
+    bool erase(const string& hash);
+
+    // up to limit hashes after `after`, in order (for list_blocks)
+    list<string> list_after(const string& after, size_t limit);
+
+    // the filter as CuckooFilter::to_words(), and the version it is of
+    string export_filter(uint64_t& at_version);
+
+  private:
+    struct Entry {
+        const string hash;
+        const uint64_t h; // CuckooFilter::key_hash(hash)
+        const BlockRef block;
+        atomic<Entry*> next;
+
+        Entry(const string& t_hash, uint64_t t_h, const BlockRef& t_block, Entry* t_next)
+            : hash(t_hash), h(t_h), block(t_block), next(t_next) {}
+    };
+
+    struct Table {
+        size_t mask; // buckets - 1, buckets a power of 2
+        atomic<Entry*>* buckets;
+
+        explicit Table(size_t n);
+        ~Table();
+        atomic<Entry*>& bucket(uint64_t h) const { return buckets[h & mask]; }
+    };
+
+    atomic<Table*> table;
+    atomic<CuckooFilter*> filter;
+    atomic<size_t> count;
+    atomic<size_t> total_bytes;
+    atomic<uint64_t> changes;
+
+    mutex mtx;          // serializes writers
+    set<string> hashes; // in order, for list_after()
+
+    const Entry* lookup(const string& hash) const;
+    void grow();
+    void rebuild_filter(size_t buckets);
+    static void free_table(Table* t, bool entries);
+
+    BlockIndex(const BlockIndex&);
+    BlockIndex& operator=(const BlockIndex&);
+};
+
+#endif // BLOCKINDEX_HPP
@@ -0,0 +1,122 @@
+#include <chrono>
+#include <future>
+#include <memory>
+#include <stdlib.h>
+
+#include "rpc/client.h"
+
+#include "logger.hpp"
+#include "ChainForwarder.hpp"
+
+using namespace std;
+
+const size_t ChainForwarder::WINDOW;
+const int ChainForwarder::TIMEOUT_MS;
+
+ChainForwarder::ChainForwarder(const string& t_node, size_t t_max_bytes)
+    : node(t_node), max_bytes(t_max_bytes), bytes(0), num_failed(0), stopping(false)
+{
+    worker = thread(&ChainForwarder::run, this);
+}
+
+ChainForwarder::~ChainForwarder()
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        stopping = true;
+    }
+    pending.notify_all();
+    worker.join();
+}
+
+bool ChainForwarder::push(const string& hash, const BlockRef& encoded, const list<string>& chain)
+{
+    {
+        lock_guard<mutex> lock(mtx);
+        if (bytes + encoded.size() > max_bytes) { return false; }
+        queue.push_back(Block{hash, encoded, chain});
+        bytes += encoded.size();
+    }
+    pending.notify_one();
+    return true;
+}
+
+size_t ChainForwarder::queued_bytes()
+{
+    lock_guard<mutex> lock(mtx);
+    return bytes;
+}
+
+void ChainForwarder::run()
+{
+    auto log = logger();
+    size_t colon = node.rfind(':');
+    string host = node.substr(0, colon);
+    int port = strtol(node.substr(colon + 1).c_str(), nullptr, 0);
+
+    unique_ptr<rpc::client> c;
+    deque<pair<string, future<RPCLIB_MSGPACK::object_handle>>> inflight;
+    while (true) {
+        Block block;
+        bool have_block = false;
+        {
+            unique_lock<mutex> lock(mtx);
+            if (inflight.empty()) {
+                pending.wait(lock, [&]() { return stopping || !queue.empty(); });
+            }
+            if (stopping) { return; }
+            if (!queue.empty() && inflight.size() < WINDOW) {
+                block = move(queue.front());
+                queue.pop_front();
+                bytes -= block.encoded.size();
+                have_block = true;
+            }
+        }
+
+        if (have_block) {
+            try {
+                if (!c) {
+                    c.reset(new rpc::client(host, port));
+                    c->set_timeout(TIMEOUT_MS); // only bounds connecting here
+                }
+                inflight.push_back(make_pair(block.hash, c->async_call("store_chain", block.hash, block.encoded, block.chain)));
+            } catch (exception &e) {
+                // the server is down: drop what is queued for it as well
+                // rather than waiting TIMEOUT_MS for each block
+                SS_RATE_LIMITED(log, spdlog::level::err, "Cannot forward blocks to {}: {}", node, e.what());
+                {
+                    lock_guard<mutex> lock(mtx);
+                    num_failed += 1 + queue.size() + inflight.size();
+                    queue.clear();
+                    bytes = 0;
+                }
+                inflight.clear();
+                c.reset();
+                this_thread::sleep_for(chrono::seconds(1));
+            }
+            continue; // fill the window first
+        }
+
+        // window full, or nothing more queued: wait for the oldest call
+        future<RPCLIB_MSGPACK::object_handle>& oldest = inflight.front().second;
+        if (oldest.wait_for(chrono::milliseconds(TIMEOUT_MS)) != future_status::ready) {
+            // rpclib never fails the calls of a connection that broke
+            SS_RATE_LIMITED(log, spdlog::level::err, "Forwarding block {} to {} timed out", inflight.front().first, node);
+            {
+                lock_guard<mutex> lock(mtx);
+                num_failed += inflight.size();
+            }
+            inflight.clear();
+            c.reset();
+            continue;
+        }
+        try {
+            oldest.get();
+        } catch (exception &e) {
+            SS_RATE_LIMITED(log, spdlog::level::err, "Forwarding block {} to {} failed: {}", inflight.front().first, node, e.what());
+            lock_guard<mutex> lock(mtx);
+            num_failed++;
+        }
+        inflight.pop_front();
+    }
+}
@@ -0,0 +1,63 @@
+#ifndef CHAINFORWARDER_HPP
+#define CHAINFORWARDER_HPP
+
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <stdint.h>
+
+#include "BlockBuffer.hpp"
+
+using namespace std;
+
+/** Passes blocks stored by store_chain() on to the next server of their
+ * chain. Every server the block servers forward to gets one ChainForwarder,
+ * with a thread of its own that keeps up to WINDOW store_chain() calls in
+ * flight. RPC worker threads therefore never wait for another server: with
+ * chains running through the same servers in every order, waiting workers
+ * would sooner or later hold every thread of a server whose turn it is.
+ * Blocks that cannot be forwarded are dropped and counted; clients find
+ * out from the tail of the chain (see missing_blocks()).
+ */
+class ChainForwarder
+{
+  public:
+    static const size_t WINDOW = 32;
+    static const int TIMEOUT_MS = 10000;
+
+    // at most max_bytes of encoded blocks are queued
+    ChainForwarder(const string& t_node, size_t t_max_bytes);
+    ~ChainForwarder();
+
+    // queue a block for node, which gets chain as the rest of the chain;
+    // false if the queue is full
+    bool push(const string& hash, const BlockRef& encoded, const list<string>& chain);
+
+    size_t queued_bytes();
+    uint64_t failed() { lock_guard<mutex> lock(mtx); return num_failed; }
+
+  private:
+    struct Block {
+        string hash;
+        BlockRef encoded; // shared with hdm
+        list<string> chain;
+    };
+
+    string node;
+    size_t max_bytes;
+
+    mutex mtx; // guards everything below
+    condition_variable pending;
+    deque<Block> queue;
+    size_t bytes;
+    uint64_t num_failed;
+    bool stopping;
+    thread worker;
+
+    void run();
+};
+
+#endif // CHAINFORWARDER_HPP
@@ -0,0 +1,158 @@
+#include "CuckooFilter.hpp"
+
+using namespace std;
+
+// moves tried before an insertion gives up
+static const int MAX_KICKS = 500;
+
+CuckooFilter::CuckooFilter(size_t buckets)
+    : mask(0), rng(0x9e3779b97f4a7c15ULL), moves(0)
+{
+    size_t n = 1;
+    while (n < buckets) { n <<= 1; }
+    mask = n - 1;
+    table.reset(new atomic<uint64_t>[n]);
+    for (size_t i = 0; i < n; i++) { table[i].store(0, memory_order_relaxed); }
+}
+
+// FNV-1a over 8-byte little-endian words, then the splitmix64 finalizer
+// (see HashRing::position)
+uint64_t CuckooFilter::key_hash(const string& key)
+{
+    uint64_t h = 14695981039346656037ULL;
+    size_t i = 0;
+    for (; i + 8 <= key.size(); i += 8) {
+        uint64_t w = 0;
+        for (int b = 7; b >= 0; b--) { w = w << 8 | (unsigned char) key[i + b]; }
+        h ^= w;
+        h *= 1099511628211ULL;
+    }
+    for (; i < key.size(); i++) {
+        h ^= (unsigned char) key[i];
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+void CuckooFilter::set_slot(size_t i, int s, uint64_t fp)
+{
+    uint64_t b = table[i].load(memory_order_relaxed);
+    b = (b & ~(0xffffULL << (16 * s))) | fp << (16 * s);
+    table[i].store(b, memory_order_release);
+}
+
+int CuckooFilter::free_slot(size_t i) const
+{
+    uint64_t b = table[i].load(memory_order_relaxed);
+    for (int s = 0; s < SLOTS; s++) {
+        if (slot(b, s) == 0) { return s; }
+    }
+    return -1;
+}
+
+bool CuckooFilter::insert(uint64_t h)
+{
+    uint64_t fp = fingerprint(h);
+    size_t i1 = h & mask;
+    size_t i2 = alt(i1, fp);
+    int s = free_slot(i1);
+    if (s >= 0) {
+        set_slot(i1, s, fp);
+        return true;
+    }
+    s = free_slot(i2);
+    if (s >= 0) {
+        set_slot(i2, s, fp);
+        return true;
+    }
+
+    // Find the path first: path[k] is a full slot whose fingerprint moves
+    // to its other bucket, which is where path[k + 1] is (or the free slot
+    // at the end). No slot is on the path twice, so what was read while
+    // searching is still there when the moves are made.
+    vector<pair<size_t, int>> path;
+    size_t i = (h >> 32) & 1 ? i1 : i2;
+    for (int kick = 0; kick < MAX_KICKS; kick++) {
+        uint64_t b = table[i].load(memory_order_relaxed);
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        int victim = -1;
+        for (int t = 0; t < SLOTS && victim < 0; t++) {
+            int cand = (rng + t) % SLOTS;
+            bool on_path = false;
+            for (const auto& p : path) { on_path = on_path || (p.first == i && p.second == cand); }
+            if (!on_path) { victim = cand; }
+        }
+        if (victim < 0) { return false; }
+        path.push_back(make_pair(i, victim));
+
+        i = alt(i, slot(b, victim));
+        int free = free_slot(i);
+        if (free >= 0) {
+            // copy, then overwrite, from the free slot back to the start;
+            // readers that miss meanwhile look again
+            uint64_t m = moves.load(memory_order_relaxed);
+            moves.store(m + 1, memory_order_relaxed);
+            atomic_thread_fence(memory_order_release);
+            size_t to = i;
+            int to_slot = free;
+            for (size_t k = path.size(); k-- > 0; ) {
+                uint64_t moving = slot(table[path[k].first].load(memory_order_relaxed), path[k].second);
+                set_slot(to, to_slot, moving);
+                to = path[k].first;
+                to_slot = path[k].second;
+            }
+            set_slot(to, to_slot, fp);
+            moves.store(m + 2, memory_order_release);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool CuckooFilter::erase(uint64_t h)
+{
+    uint64_t fp = fingerprint(h);
+    size_t i1 = h & mask;
+    size_t buckets[2] = { i1, alt(i1, fp) };
+    for (size_t i : buckets) {
+        uint64_t b = table[i].load(memory_order_relaxed);
+        for (int s = 0; s < SLOTS; s++) {
+            if (slot(b, s) == fp) {
+                set_slot(i, s, 0);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+string CuckooFilter::to_words() const
+{
+    string words(bytes(), '\0');
+    for (size_t i = 0; i <= mask; i++) {
+        uint64_t b = table[i].load(memory_order_relaxed);
+        for (int k = 0; k < 8; k++) { words[8 * i + k] = (char) (b >> (8 * k)); }
+    }
+    return words;
+}
+
+bool CuckooFilter::from_words(const string& words)
+{
+    size_t n = words.size() / 8;
+    if (n == 0 || words.size() % 8 != 0 || (n & (n - 1)) != 0) { return false; }
+    table.reset(new atomic<uint64_t>[n]);
+    mask = n - 1;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t b = 0;
+        for (int k = 7; k >= 0; k--) { b = b << 8 | (unsigned char) words[8 * i + k]; }
+        table[i].store(b, memory_order_relaxed);
+    }
+    return true;
+}
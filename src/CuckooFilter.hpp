@@ -0,0 +1,101 @@
+#ifndef CUCKOOFILTER_HPP
+#define CUCKOOFILTER_HPP
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+/** Approximate set membership of block hashes: a cuckoo filter.
+ * Each key leaves a 16-bit fingerprint in one of two buckets of 4 slots,
+ * the second derived from the first and the fingerprint alone, so entries
+ * can be moved (and removed) without the key. maybe_contains() reads the
+ * two buckets, one 64-bit word each: false means the key was never
+ * inserted (or was erased), true is wrong for at most about 1 key in 8000
+ * (8 fingerprints compared, 1 in 65536 each to match by chance).
+ *
+ * Readers take no lock. Writers are serialized by the caller and never
+ * let a fingerprint disappear while it moves: a full bucket makes room by
+ * finding a path of moves to a free slot first, then copying each
+ * fingerprint to its new place before overwriting the old one, from the
+ * end of the path back. A reader's two bucket loads may still straddle a
+ * move (the new bucket read before the copy, the old one after the
+ * overwrite), so moves are counted like a seqlock: odd while one is under
+ * way, and a miss is only reported if the count was even and unchanged
+ * around it. Insertion fails once no short path exists; the owner then
+ * builds a bigger filter.
+ */
+class CuckooFilter
+{
+  public:
+    static const int SLOTS = 4;
+
+    // buckets is rounded up to a power of 2
+    explicit CuckooFilter(size_t buckets);
+
+    // key_hash() of a key: the same on every platform, so a filter built
+    // here answers for keys hashed elsewhere
+    static uint64_t key_hash(const string& key);
+
+    bool maybe_contains(uint64_t h) const
+    {
+        uint64_t fp = fingerprint(h);
+        size_t i1 = h & mask;
+        size_t i2 = alt(i1, fp);
+        while (true) {
+            uint64_t m = moves.load(memory_order_acquire);
+            if (has(table[i1].load(memory_order_relaxed), fp) || has(table[i2].load(memory_order_relaxed), fp)) {
+                return true;
+            }
+            atomic_thread_fence(memory_order_acquire);
+            if (!(m & 1) && moves.load(memory_order_relaxed) == m) { return false; }
+        }
+    }
+    bool maybe_contains(const string& key) const { return maybe_contains(key_hash(key)); }
+
+    // false if there is no room (nothing changed)
+    bool insert(uint64_t h);
+    // removes one fingerprint of h; only for keys that were inserted
+    bool erase(uint64_t h);
+
+    size_t bucket_count() const { return mask + 1; }
+    size_t bytes() const { return bucket_count() * sizeof(uint64_t); }
+
+    // the buckets as little-endian 64-bit words, to ship the filter to
+    // another process; no writer may run meanwhile
+    string to_words() const;
+    // replace the filter with one from to_words(); false if words is not
+    // a power of 2 of them (nothing changed)
+    bool from_words(const string& words);
+
+  private:
+    size_t mask;
+    unique_ptr<atomic<uint64_t>[]> table; // SLOTS fingerprints per bucket, 0 = free
+    uint64_t rng; // picks the fingerprints to move, writers only
+    atomic<uint64_t> moves; // 2 per insertion that moved fingerprints; odd during one
+
+    static uint64_t fingerprint(uint64_t h)
+    {
+        uint64_t fp = h >> 48;
+        return fp ? fp : 1;
+    }
+    size_t alt(size_t i, uint64_t fp) const { return (i ^ (fp * 0x5bd1e995)) & mask; }
+
+    // a slot of the bucket word b holds fp
+    static bool has(uint64_t b, uint64_t fp)
+    {
+        uint64_t x = b ^ (fp * 0x0001000100010001ULL);
+        return ((x - 0x0001000100010001ULL) & ~x & 0x8000800080008000ULL) != 0;
+    }
+    static uint64_t slot(uint64_t b, int s) { return (b >> (16 * s)) & 0xffff; }
+    void set_slot(size_t i, int s, uint64_t fp);
+    int free_slot(size_t i) const;
+
+    CuckooFilter(const CuckooFilter&);
+    CuckooFilter& operator=(const CuckooFilter&);
+};
+
+#endif // CUCKOOFILTER_HPP
@@ -0,0 +1,146 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "logger.hpp"
+#include "DirWalker.hpp"
+
+using namespace std;
+
+// record layout returned by the getdents64 system call
+struct linux_dirent64 {
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1]; // actually d_reclen - 19 bytes, NUL terminated
+};
+
+static const size_t GETDENTS_BUFSIZE = 256 * 1024;
+
+// shared state of one walk: a queue of directories still to be read
+struct WalkState {
+    int rootfd;
+    mutex mtx;
+    condition_variable cv;
+    deque<string> todo;
+    int busy; // directories queued or being read
+    vector<string> files;
+    vector<string> dirs;
+};
+
+static string join(const string& dir, const char* name)
+{
+    return dir.empty() ? string(name) : dir + "/" + name;
+}
+
+// Read one directory, queueing its subdirectories
+static void read_dir(WalkState& st, const string& rel, vector<char>& buf,
+                     vector<string>& files, vector<string>& subdirs)
+{
+    auto log = logger();
+    int fd = rel.empty() ? dup(st.rootfd)
+                         : openat(st.rootfd, rel.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC | O_NOFOLLOW);
+    if (fd < 0) {
+        log->error("cannot open directory '{}': {}", rel, strerror(errno));
+        return;
+    }
+
+    while (true) {
+        long n = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+        if (n < 0) {
+            log->error("cannot read directory '{}': {}", rel, strerror(errno));
+            break;
+        }
+        if (n == 0) { break; }
+
+        for (long off = 0; off < n; ) {
+            struct linux_dirent64* d = (struct linux_dirent64*) (buf.data() + off);
+            off += d->d_reclen;
+
+            if (d->d_name[0] == '.') { continue; } // ".", ".." and hidden entries
+
+            unsigned char type = d->d_type;
+            if (type == DT_UNKNOWN) {
+                struct statx stx;
+                if (statx(fd, d->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_TYPE, &stx) != 0) {
+                    continue;
+                }
+                type = S_ISDIR(stx.stx_mode) ? DT_DIR : S_ISREG(stx.stx_mode) ? DT_REG : DT_UNKNOWN;
+            }
+
+            if (type == DT_DIR) {
+                subdirs.push_back(join(rel, d->d_name));
+            } else if (type == DT_REG) {
+                files.push_back(join(rel, d->d_name));
+            }
+        }
+    }
+    close(fd);
+}
+
+static void walk_worker(WalkState& st)
+{
+    vector<char> buf(GETDENTS_BUFSIZE);
+    vector<string> files, dirs, subdirs;
+
+    unique_lock<mutex> lock(st.mtx);
+    while (true) {
+        st.cv.wait(lock, [&]() { return !st.todo.empty() || st.busy == 0; });
+        if (st.todo.empty()) { break; } // nothing queued and nobody busy: done
+
+        string rel = st.todo.front();
+        st.todo.pop_front();
+        lock.unlock();
+
+        subdirs.clear();
+        read_dir(st, rel, buf, files, subdirs);
+        dirs.push_back(rel);
+
+        lock.lock();
+        for (string& s : subdirs) { st.todo.push_back(s); }
+        st.busy += subdirs.size();
+        st.busy--;
+        st.cv.notify_all();
+    }
+
+    st.files.insert(st.files.end(), files.begin(), files.end());
+    st.dirs.insert(st.dirs.end(), dirs.begin(), dirs.end());
+}
+
+vector<string> walk_tree(const string& root, int threads, vector<string>* dirs)
+{
+    auto log = logger();
+    WalkState st;
+    st.rootfd = open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (st.rootfd < 0) {
+        log->error("cannot open directory '{}': {}", root, strerror(errno));
+        return vector<string>();
+    }
+    st.todo.push_back("");
+    st.busy = 1;
+
+    if (threads < 1) { threads = 1; }
+    vector<thread> workers;
+    for (int i = 1; i < threads; i++) {
+        workers.push_back(thread(walk_worker, ref(st)));
+    }
+    walk_worker(st);
+    for (thread& t : workers) { t.join(); }
+    close(st.rootfd);
+
+    sort(st.files.begin(), st.files.end());
+    if (dirs) {
+        sort(st.dirs.begin(), st.dirs.end());
+        dirs->swap(st.dirs);
+    }
+    return st.files;
+}
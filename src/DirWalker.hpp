@@ -0,0 +1,20 @@
+#ifndef DIRWALKER_HPP
+#define DIRWALKER_HPP
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+/** Recursively list the regular files below root.
+ * Paths are returned relative to root ("dir/sub/file.txt"), sorted.
+ * Entries whose name starts with '.' (and everything below them) and
+ * symbolic links are skipped. Directories are read in large getdents64
+ * batches; statx (type only) is needed just for filesystems that do not
+ * report d_type. Subdirectories are spread across up to `threads` threads.
+ * If dirs is given, it receives the relative path of every directory
+ * visited, including "" for root itself.
+ */
+vector<string> walk_tree(const string& root, int threads, vector<string>* dirs = nullptr);
+
+#endif // DIRWALKER_HPP
@@ -0,0 +1,93 @@
+#include <new>
+#include <stdlib.h>
+
+#include "EpochGC.hpp"
+
+using namespace std;
+
+EpochGC& EpochGC::instance()
+{
+    static EpochGC gc;
+    return gc;
+}
+
+EpochGC::EpochGC()
+    : epoch(1), slots(nullptr)
+{
+}
+
+// the calling thread's slot; slots are never freed, a thread that exits
+// leaves an idle slot behind
+EpochGC::Slot* EpochGC::slot()
+{
+    static thread_local Slot* mine = nullptr;
+    if (!mine) {
+        void* mem = nullptr;
+        if (posix_memalign(&mem, alignof(Slot), sizeof(Slot)) != 0) { throw bad_alloc(); }
+        mine = new (mem) Slot();
+        mine->state.store(0);
+        mine->depth = 0;
+        Slot* head = slots.load();
+        do {
+            mine->next = head;
+        } while (!slots.compare_exchange_weak(head, mine));
+    }
+    return mine;
+}
+
+void EpochGC::enter()
+{
+    Slot* s = slot();
+    if (s->depth++ > 0) { return; }
+    s->state.store(epoch.load() << 1 | 1);
+    // the announcement is visible before any node is read
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
+void EpochGC::leave()
+{
+    Slot* s = slot();
+    if (--s->depth > 0) { return; }
+    s->state.store(0, memory_order_release);
+}
+
+EpochGC::Guard::Guard() { EpochGC::instance().enter(); }
+EpochGC::Guard::~Guard() { EpochGC::instance().leave(); }
+
+void EpochGC::retire(function<void()> free)
+{
+    {
+        lock_guard<mutex> lock(retired_mtx);
+        retired.push_back(make_pair(epoch.load(), move(free)));
+    }
+    collect();
+}
+
+void EpochGC::collect()
+{
+    deque<pair<uint64_t, function<void()>>> ready;
+    {
+        lock_guard<mutex> lock(retired_mtx);
+        // pairs with the fence in enter(): either the scan sees a reader's
+        // announcement, or that reader sees the unlinking done before retire()
+        atomic_thread_fence(memory_order_seq_cst);
+        // advance the epoch if every reader inside a Guard entered at the
+        // current one
+        uint64_t e = epoch.load();
+        bool caught_up = true;
+        for (Slot* s = slots.load(); s; s = s->next) {
+            uint64_t state = s->state.load();
+            if ((state & 1) && (state >> 1) != e) {
+                caught_up = false;
+                break;
+            }
+        }
+        if (caught_up) { epoch.store(++e); }
+
+        while (!retired.empty() && retired.front().first + 2 <= e) {
+            ready.push_back(move(retired.front()));
+            retired.pop_front();
+        }
+    }
+    for (auto& r : ready) { r.second(); }
+}
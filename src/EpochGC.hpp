@@ -0,0 +1,64 @@
+#ifndef EPOCHGC_HPP
+#define EPOCHGC_HPP
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <stdint.h>
+
+using namespace std;
+
+/** Epoch-based reclamation for lock-free readers.
+ * Readers wrap every access to shared nodes in a Guard, which announces the
+ * global epoch the thread entered at in a slot of its own (one cache line
+ * per thread, so readers never write to shared memory). Writers unlink a
+ * node first and then retire() it: it is freed once the global epoch has
+ * advanced twice after that, by which time every reader that could still
+ * see it has left. The epoch only advances when every active reader has
+ * caught up with it, so a reader that stays inside a Guard holds up
+ * reclamation (not writers). Retired nodes are collected on later
+ * retire() calls.
+ */
+class EpochGC
+{
+  public:
+    // the process-wide domain
+    static EpochGC& instance();
+
+    class Guard
+    {
+      public:
+        Guard();
+        ~Guard();
+      private:
+        Guard(const Guard&);
+        Guard& operator=(const Guard&);
+    };
+
+    // free() runs once no reader can hold what it frees
+    void retire(function<void()> free);
+
+  private:
+    // a cache line of its own; plain new does not align to 64 in C++11,
+    // see slot()
+    struct alignas(64) Slot {
+        atomic<uint64_t> state; // 0: outside a Guard; else epoch << 1 | 1
+        int depth;              // nested Guards, owner thread only
+        Slot* next;
+    };
+
+    atomic<uint64_t> epoch;
+    atomic<Slot*> slots; // every thread that ever entered a Guard
+
+    mutex retired_mtx; // guards retired
+    deque<pair<uint64_t, function<void()>>> retired;
+
+    EpochGC();
+    Slot* slot();
+    void enter();
+    void leave();
+    void collect();
+};
+
+#endif // EPOCHGC_HPP
@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ErasureCode.hpp"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define EC_SSSE3 1
+#include <tmmintrin.h>
+#endif
+
+using namespace std;
+
+const int ErasureCode::MAX_FRAGMENTS;
+
+// every fragment starts with the length of the block
+static const size_t HEADER = 4;
+
+// GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 (0x11d)
+struct GaloisField {
+    uint8_t exp[512];
+    uint8_t log[256];
+    uint8_t mul[256][256];
+
+    GaloisField()
+    {
+        int x = 1;
+        for (int i = 0; i < 255; i++) {
+            exp[i] = exp[i + 255] = (uint8_t) x;
+            log[x] = (uint8_t) i;
+            x <<= 1;
+            if (x & 0x100) { x ^= 0x11d; }
+        }
+        exp[510] = exp[511] = exp[0];
+        log[0] = 0; // never used: 0 has no logarithm
+        for (int a = 0; a < 256; a++) {
+            for (int b = 0; b < 256; b++) {
+                mul[a][b] = (a == 0 || b == 0) ? 0 : exp[log[a] + log[b]];
+            }
+        }
+    }
+
+    uint8_t inv(uint8_t a) const { return exp[255 - log[a]]; }
+};
+
+static const GaloisField& gf()
+{
+    static const GaloisField field;
+    return field;
+}
+
+static void mul_add_scalar(uint8_t* dst, const uint8_t* src, uint8_t c, size_t n)
+{
+    const uint8_t* row = gf().mul[c];
+    for (size_t i = 0; i < n; i++) { dst[i] ^= row[src[i]]; }
+}
+
+#ifdef EC_SSSE3
+// c * x = c * (x & 0x0f) ^ c * (x & 0xf0): two 16-entry tables, looked up
+// 16 bytes at a time with pshufb
+__attribute__((target("ssse3")))
+static void mul_add_ssse3(uint8_t* dst, const uint8_t* src, uint8_t c, size_t n)
+{
+    const uint8_t* row = gf().mul[c];
+    uint8_t lo[16], hi[16];
+    for (int i = 0; i < 16; i++) {
+        lo[i] = row[i];
+        hi[i] = row[i << 4];
+    }
+    const __m128i tlo = _mm_loadu_si128((const __m128i*) lo);
+    const __m128i thi = _mm_loadu_si128((const __m128i*) hi);
+    const __m128i mask = _mm_set1_epi8(0x0f);
+
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*) (src + i));
+        __m128i l = _mm_shuffle_epi8(tlo, _mm_and_si128(v, mask));
+        __m128i h = _mm_shuffle_epi8(thi, _mm_and_si128(_mm_srli_epi64(v, 4), mask));
+        __m128i d = _mm_loadu_si128((const __m128i*) (dst + i));
+        _mm_storeu_si128((__m128i*) (dst + i), _mm_xor_si128(d, _mm_xor_si128(l, h)));
+    }
+    mul_add_scalar(dst + i, src + i, c, n - i);
+}
+#endif
+
+// dst ^= c * src over n bytes
+static void mul_add(uint8_t* dst, const uint8_t* src, uint8_t c, size_t n)
+{
+    if (c == 0) { return; }
+#ifdef EC_SSSE3
+    static const bool ssse3 = __builtin_cpu_supports("ssse3");
+    if (ssse3) {
+        mul_add_ssse3(dst, src, c, n);
+        return;
+    }
+#endif
+    mul_add_scalar(dst, src, c, n);
+}
+
+ErasureCode::ErasureCode(int t_k, int t_m)
+    : k(t_k), m(t_m)
+{
+    // Cauchy matrix: row i, column j is 1 / (x_i + y_j) with x_i = i and
+    // y_j = m + j, all distinct, so the sum is never 0
+    parity.resize(m * k);
+    for (int i = 0; i < m; i++) {
+        for (int j = 0; j < k; j++) {
+            parity[i * k + j] = gf().inv((uint8_t) (i ^ (m + j)));
+        }
+    }
+}
+
+bool ErasureCode::parse(const string& spec, int& k, int& m)
+{
+    const char* s = spec.c_str();
+    char* end;
+    long dk = strtol(s, &end, 10);
+    if (end == s || *end != '+') { return false; }
+    s = end + 1;
+    long pm = strtol(s, &end, 10);
+    if (end == s || *end != '\0') { return false; }
+    if (dk < 1 || pm < 1 || dk + pm > MAX_FRAGMENTS) { return false; }
+    k = (int) dk;
+    m = (int) pm;
+    return true;
+}
+
+vector<string> ErasureCode::encode(const string& block) const
+{
+    size_t shard = (block.size() + k - 1) / k;
+    uint32_t len = (uint32_t) block.size();
+    char header[HEADER] = { (char) (len & 0xff), (char) ((len >> 8) & 0xff),
+                            (char) ((len >> 16) & 0xff), (char) ((len >> 24) & 0xff) };
+
+    vector<string> fragments(k + m, string(header, HEADER) + string(shard, '\0'));
+    for (int j = 0; j < k; j++) {
+        size_t start = j * shard;
+        if (start >= block.size()) { break; }
+        size_t n = block.size() - start < shard ? block.size() - start : shard;
+        memcpy(&fragments[j][HEADER], block.data() + start, n);
+    }
+    for (int i = 0; i < m; i++) {
+        uint8_t* dst = (uint8_t*) &fragments[k + i][HEADER];
+        for (int j = 0; j < k; j++) {
+            mul_add(dst, (const uint8_t*) fragments[j].data() + HEADER, parity[i * k + j], shard);
+        }
+    }
+    return fragments;
+}
+
+bool ErasureCode::decode(const map<int, string>& fragments, string& block) const
+{
+    // any k fragments do; the map lists data fragments first
+    vector<int> rows;
+    vector<const string*> have;
+    for (const auto& kv : fragments) {
+        if (kv.first < 0 || kv.first >= k + m || kv.second.size() < HEADER) { return false; }
+        if (!have.empty() && kv.second.size() != have[0]->size()) { return false; }
+        rows.push_back(kv.first);
+        have.push_back(&kv.second);
+        if ((int) rows.size() == k) { break; }
+    }
+    if ((int) rows.size() < k) { return false; }
+
+    const unsigned char* h = (const unsigned char*) have[0]->data();
+    size_t len = h[0] | (h[1] << 8) | (h[2] << 16) | ((size_t) h[3] << 24);
+    size_t shard = have[0]->size() - HEADER;
+    if (len > shard * k) { return false; }
+
+    vector<string> data(k);
+    for (int r = 0; r < k; r++) {
+        if (rows[r] < k) { data[rows[r]] = have[r]->substr(HEADER); }
+    }
+
+    if (rows[k - 1] >= k) {
+        // some data fragments are missing: invert the generator rows of the
+        // fragments we have (Gauss-Jordan), data = a^-1 * fragments
+        const GaloisField& f = gf();
+        vector<uint8_t> a(k * k, 0), inv(k * k, 0);
+        for (int r = 0; r < k; r++) {
+            if (rows[r] < k) { a[r * k + rows[r]] = 1; }
+            else { copy(parity.begin() + (rows[r] - k) * k, parity.begin() + (rows[r] - k + 1) * k, a.begin() + r * k); }
+            inv[r * k + r] = 1;
+        }
+        for (int col = 0; col < k; col++) {
+            int pivot = col;
+            while (pivot < k && a[pivot * k + col] == 0) { pivot++; }
+            if (pivot == k) { return false; }
+            if (pivot != col) {
+                swap_ranges(a.begin() + pivot * k, a.begin() + (pivot + 1) * k, a.begin() + col * k);
+                swap_ranges(inv.begin() + pivot * k, inv.begin() + (pivot + 1) * k, inv.begin() + col * k);
+            }
+            uint8_t scale = f.inv(a[col * k + col]);
+            for (int j = 0; j < k; j++) {
+                a[col * k + j] = f.mul[scale][a[col * k + j]];
+                inv[col * k + j] = f.mul[scale][inv[col * k + j]];
+            }
+            for (int r = 0; r < k; r++) {
+                uint8_t factor = a[r * k + col];
+                if (r == col || factor == 0) { continue; }
+                for (int j = 0; j < k; j++) {
+                    a[r * k + j] ^= f.mul[factor][a[col * k + j]];
+                    inv[r * k + j] ^= f.mul[factor][inv[col * k + j]];
+                }
+            }
+        }
+
+        for (int j = 0; j < k; j++) {
+            if (!data[j].empty() || shard == 0) { continue; }
+            data[j].assign(shard, '\0');
+            for (int r = 0; r < k; r++) {
+                mul_add((uint8_t*) &data[j][0], (const uint8_t*) have[r]->data() + HEADER, inv[j * k + r], shard);
+            }
+        }
+    }
+
+    block.clear();
+    block.reserve(shard * k);
+    for (int j = 0; j < k; j++) { block += data[j]; }
+    block.resize(len);
+    return true;
+}
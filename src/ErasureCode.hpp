@@ -0,0 +1,52 @@
+#ifndef ERASURECODE_HPP
+#define ERASURECODE_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+/** Reed-Solomon erasure coding of blocks over GF(2^8).
+ * A block is cut into k data fragments and m parity fragments are computed
+ * from them, so that any k of the k + m fragments give the block back:
+ * storing them on k + m servers survives m failures at (k + m) / k times
+ * the size of the block. The code is systematic (data fragments are slices
+ * of the block, so a read that gets all of them does no arithmetic) and the
+ * parity rows form a Cauchy matrix, which keeps every k x k submatrix of
+ * the generator invertible. Each fragment starts with the length of the
+ * block (4 bytes, little endian) so that the padding of the last data
+ * fragment can be dropped. The inner loop, dst ^= c * src over a fragment,
+ * uses SSSE3 nibble lookups (pshufb) when the CPU has them.
+ */
+class ErasureCode
+{
+  public:
+    // GF(2^8) has room for this many distinct fragments
+    static const int MAX_FRAGMENTS = 256;
+
+    // k = 0: disabled
+    ErasureCode(int t_k = 0, int t_m = 0);
+
+    bool enabled() const { return k > 0; }
+    int data_fragments() const { return k; }
+    int fragments() const { return k + m; }
+
+    // the k + m fragments of block, data fragments first
+    vector<string> encode(const string& block) const;
+
+    // the block, from at least k fragments by index; false if there are
+    // fewer or they do not fit together
+    bool decode(const map<int, string>& fragments, string& block) const;
+
+    // parse "k+m", e.g. "4+2"; false if malformed or out of range
+    static bool parse(const string& spec, int& k, int& m);
+
+  private:
+    int k;
+    int m;
+    vector<uint8_t> parity; // m x k coefficients, row-major
+};
+
+#endif // ERASURECODE_HPP
@@ -0,0 +1,71 @@
+#include <algorithm>
+
+#include "HashRing.hpp"
+
+using namespace std;
+
+HashRing::HashRing(int t_vnodes)
+    : vnodes(t_vnodes < 1 ? 1 : t_vnodes)
+{
+}
+
+// FNV-1a followed by the splitmix64 finalizer, so that similar inputs
+// ("host:9001#3", "host:9001#4") land far apart on the ring
+uint64_t HashRing::position(const string& s)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (unsigned char ch : s) {
+        h ^= ch;
+        h *= 1099511628211ULL;
+    }
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+void HashRing::add(const string& node)
+{
+    if (find(members.begin(), members.end(), node) != members.end()) { return; }
+    members.push_back(node);
+    for (int i = 0; i < vnodes; i++) {
+        ring.insert(make_pair(position(node + "#" + to_string(i)), node));
+    }
+}
+
+void HashRing::remove(const string& node)
+{
+    auto it = find(members.begin(), members.end(), node);
+    if (it == members.end()) { return; }
+    members.erase(it);
+    for (auto rit = ring.begin(); rit != ring.end(); ) {
+        if (rit->second == node) { rit = ring.erase(rit); } else { ++rit; }
+    }
+}
+
+const string& HashRing::owner(const string& key) const
+{
+    auto it = ring.lower_bound(position(key));
+    if (it == ring.end()) { it = ring.begin(); } // wrap around
+    return it->second;
+}
+
+vector<string> HashRing::successors(const string& key) const
+{
+    vector<string> order;
+    if (ring.empty()) { return order; }
+
+    auto start = ring.lower_bound(position(key));
+    if (start == ring.end()) { start = ring.begin(); }
+    auto it = start;
+    do {
+        if (find(order.begin(), order.end(), it->second) == order.end()) {
+            order.push_back(it->second);
+            if (order.size() == members.size()) { break; }
+        }
+        if (++it == ring.end()) { it = ring.begin(); }
+    } while (it != start);
+    return order;
+}
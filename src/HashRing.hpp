@@ -0,0 +1,47 @@
+#ifndef HASHRING_HPP
+#define HASHRING_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+/** Consistent hashing of block hashes onto block servers.
+ * Every node (a "host:port" address) is placed at vnodes pseudo-random
+ * points of a 64-bit ring, and a key belongs to the first node point at or
+ * after the key's own position. Adding a node therefore only moves the keys
+ * that now land on its points, about 1/N of them, each away from the node
+ * that follows it on the ring; removing a node hands its keys to its
+ * successors. Everybody building a ring from the same nodes and vnodes
+ * agrees on every owner.
+ */
+class HashRing
+{
+  public:
+    static const int DEFAULT_VNODES = 128;
+
+    HashRing(int t_vnodes = DEFAULT_VNODES);
+
+    void add(const string& node);
+    void remove(const string& node);
+
+    bool empty() const { return members.empty(); }
+    const vector<string>& nodes() const { return members; }
+
+    // the node a key belongs to; the ring must not be empty
+    const string& owner(const string& key) const;
+
+    // every node, in the order the ring reaches them starting at key's owner
+    vector<string> successors(const string& key) const;
+
+  private:
+    int vnodes;
+    map<uint64_t, string> ring;
+    vector<string> members;
+
+    static uint64_t position(const string& s);
+};
+
+#endif // HASHRING_HPP
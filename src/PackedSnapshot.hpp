@@ -0,0 +1,55 @@
+#ifndef PACKEDSNAPSHOT_HPP
+#define PACKEDSNAPSHOT_HPP
+
+#include <memory>
+#include <stdint.h>
+
+#include "rpc/config.h"
+#include "rpc/msgpack.hpp"
+
+using namespace std;
+
+/** An immutable msgpack object tree of a value, built once and returned by
+ * any number of RPC calls. Returning a value from a handler converts it to
+ * such a tree from scratch (every string copied into the reply's zone);
+ * returning a shared_ptr<const PackedSnapshot> instead hands rpclib the
+ * tree that is already there, kept alive by a finalizer of the reply's
+ * zone, so that a reply only costs packing it into the output buffer.
+ */
+class PackedSnapshot
+{
+  public:
+    template <typename T>
+    PackedSnapshot(const T& value, size_t t_bytes)
+        : zone(new RPCLIB_MSGPACK::zone()), obj(value, *zone), bytes(t_bytes) {}
+
+    const RPCLIB_MSGPACK::object& get() const { return obj; }
+
+    // payload size, for the stats
+    size_t size() const { return bytes; }
+
+  private:
+    unique_ptr<RPCLIB_MSGPACK::zone> zone; // holds the tree
+    RPCLIB_MSGPACK::object obj;
+    size_t bytes;
+};
+
+namespace RPCLIB_MSGPACK {
+MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) {
+namespace adaptor {
+
+template <>
+struct object_with_zone<shared_ptr<const PackedSnapshot>> {
+    static void release(void* snapshot) { delete static_cast<shared_ptr<const PackedSnapshot>*>(snapshot); }
+
+    void operator()(RPCLIB_MSGPACK::object::with_zone& o, const shared_ptr<const PackedSnapshot>& v) const {
+        static_cast<RPCLIB_MSGPACK::object&>(o) = v->get();
+        o.zone.push_finalizer(&release, new shared_ptr<const PackedSnapshot>(v));
+    }
+};
+
+} // namespace adaptor
+} // MSGPACK_API_VERSION_NAMESPACE
+} // namespace RPCLIB_MSGPACK
+
+#endif // PACKEDSNAPSHOT_HPP
@@ -0,0 +1,253 @@
+#ifndef PERSISTENTMAP_HPP
+#define PERSISTENTMAP_HPP
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <vector>
+#include <stdint.h>
+
+#include "rpc/config.h"
+#include "rpc/msgpack.hpp"
+
+using namespace std;
+
+/** An immutable ordered map (an AVL tree with path copying). set() and
+ * erase() leave the map alone and return a new one that shares all but
+ * the O(log n) nodes on the path to the key, so a copy of a map is an O(1)
+ * snapshot that later changes never touch. Entries are shared between the
+ * copies of a node, so the path copy never copies keys or values.
+ *
+ * A map that several threads use is published through snapshot() and
+ * publish(), which load and store its root atomically: readers take a
+ * snapshot and never wait for a writer, writers (serialized among
+ * themselves by the caller) build the next version and publish it.
+ */
+template <typename K, typename V>
+class PersistentMap
+{
+  public:
+    PersistentMap() {}
+
+    size_t size() const { return root ? root->count : 0; }
+    bool empty() const { return !root; }
+
+    // the value of key, or nullptr; valid as long as this map is
+    const V* find(const K& key) const
+    {
+        const Node* n = root.get();
+        while (n) {
+            if (key < n->key()) { n = n->left.get(); }
+            else if (n->key() < key) { n = n->right.get(); }
+            else { return &n->entry->second; }
+        }
+        return nullptr;
+    }
+
+    PersistentMap set(const K& key, const V& value) const
+    {
+        return PersistentMap(insert(root, make_shared<const Entry>(key, value)));
+    }
+    PersistentMap erase(const K& key) const { return PersistentMap(remove(root, key)); }
+
+    // f(key, value) for every entry, in key order
+    template <typename F>
+    void for_each(F f) const
+    {
+        vector<const Node*> path;
+        const Node* n = root.get();
+        while (n || !path.empty()) {
+            for (; n; n = n->left.get()) { path.push_back(n); }
+            n = path.back();
+            path.pop_back();
+            f(n->entry->first, n->entry->second);
+            n = n->right.get();
+        }
+    }
+
+    map<K, V> to_map() const
+    {
+        map<K, V> m;
+        for_each([&](const K& key, const V& value) { m.emplace_hint(m.end(), key, value); });
+        return m;
+    }
+
+    // both are the same version of a map
+    bool same(const PersistentMap& other) const { return root == other.root; }
+
+    PersistentMap snapshot() const { return PersistentMap(atomic_load(&root)); }
+    void publish(const PersistentMap& next) { atomic_store(&root, next.root); }
+
+  private:
+    typedef pair<K, V> Entry;
+    typedef shared_ptr<const Entry> EntryPtr;
+    struct Node;
+    typedef shared_ptr<const Node> NodePtr;
+
+    struct Node {
+        EntryPtr entry;
+        NodePtr left, right;
+        int height;
+        size_t count;
+
+        Node(const EntryPtr& t_entry, const NodePtr& t_left, const NodePtr& t_right)
+            : entry(t_entry), left(t_left), right(t_right),
+              height(1 + max(height_of(t_left), height_of(t_right))),
+              count(1 + count_of(t_left) + count_of(t_right)) {}
+
+        const K& key() const { return entry->first; }
+    };
+
+    NodePtr root;
+
+    explicit PersistentMap(const NodePtr& t_root) : root(t_root) {}
+
+    static int height_of(const NodePtr& n) { return n ? n->height : 0; }
+    static size_t count_of(const NodePtr& n) { return n ? n->count : 0; }
+
+    static NodePtr make(const EntryPtr& entry, const NodePtr& left, const NodePtr& right)
+    {
+        return make_shared<const Node>(entry, left, right);
+    }
+
+    // a node with these children, rotated back into AVL balance
+    static NodePtr balance(const EntryPtr& entry, const NodePtr& left, const NodePtr& right)
+    {
+        int diff = height_of(left) - height_of(right);
+        if (diff > 1) {
+            if (height_of(left->left) >= height_of(left->right)) {
+                return make(left->entry, left->left, make(entry, left->right, right));
+            }
+            const NodePtr& lr = left->right;
+            return make(lr->entry, make(left->entry, left->left, lr->left), make(entry, lr->right, right));
+        }
+        if (diff < -1) {
+            if (height_of(right->right) >= height_of(right->left)) {
+                return make(right->entry, make(entry, left, right->left), right->right);
+            }
+            const NodePtr& rl = right->left;
+            return make(rl->entry, make(entry, left, rl->left), make(right->entry, rl->right, right->right));
+        }
+        return make(entry, left, right);
+    }
+
+    static NodePtr insert(const NodePtr& n, const EntryPtr& entry)
+    {
+        if (!n) { return make(entry, NodePtr(), NodePtr()); }
+        if (entry->first < n->key()) { return balance(n->entry, insert(n->left, entry), n->right); }
+        if (n->key() < entry->first) { return balance(n->entry, n->left, insert(n->right, entry)); }
+        return make(entry, n->left, n->right);
+    }
+
+    // n without its smallest entry, which goes to *min
+    static NodePtr remove_min(const NodePtr& n, EntryPtr* min)
+    {
+        if (!n->left) {
+            *min = n->entry;
+            return n->right;
+        }
+        return balance(n->entry, remove_min(n->left, min), n->right);
+    }
+
+    static NodePtr remove(const NodePtr& n, const K& key)
+    {
+        if (!n) { return n; }
+        if (key < n->key()) {
+            NodePtr left = remove(n->left, key);
+            return left == n->left ? n : balance(n->entry, left, n->right);
+        }
+        if (n->key() < key) {
+            NodePtr right = remove(n->right, key);
+            return right == n->right ? n : balance(n->entry, n->left, right);
+        }
+        if (!n->right) { return n->left; }
+        EntryPtr min;
+        NodePtr right = remove_min(n->right, &min);
+        return balance(min, n->left, right);
+    }
+};
+
+/** Snapshots of the shards of a map split by key: one map to read. */
+template <typename K, typename V>
+struct PersistentMapShards
+{
+    vector<PersistentMap<K, V>> shards;
+
+    size_t size() const
+    {
+        size_t n = 0;
+        for (const auto& s : shards) { n += s.size(); }
+        return n;
+    }
+
+    bool empty() const { return size() == 0; }
+
+    // f(key, value) for every entry, in key order within each shard
+    template <typename F>
+    void for_each(F f) const
+    {
+        for (const auto& s : shards) { s.for_each(f); }
+    }
+
+    map<K, V> to_map() const
+    {
+        map<K, V> m;
+        for_each([&](const K& key, const V& value) { m.emplace(key, value); });
+        return m;
+    }
+
+    // both are the same version of every shard
+    bool same(const PersistentMapShards& other) const
+    {
+        if (shards.size() != other.shards.size()) { return false; }
+        for (size_t i = 0; i < shards.size(); i++) {
+            if (!shards[i].same(other.shards[i])) { return false; }
+        }
+        return true;
+    }
+};
+
+namespace RPCLIB_MSGPACK {
+MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) {
+namespace adaptor {
+
+// both pack like the std::map of the same entries
+template <typename Map, typename K, typename V>
+void persistent_map_object(RPCLIB_MSGPACK::object::with_zone& o, const Map& v)
+{
+    o.type = RPCLIB_MSGPACK::type::MAP;
+    o.via.map.ptr = nullptr;
+    o.via.map.size = 0;
+    if (v.empty()) { return; }
+
+    uint32_t size = checked_get_container_size(v.size());
+    RPCLIB_MSGPACK::object_kv* p = static_cast<RPCLIB_MSGPACK::object_kv*>(
+        o.zone.allocate_align(sizeof(RPCLIB_MSGPACK::object_kv) * size, MSGPACK_ZONE_ALIGNOF(RPCLIB_MSGPACK::object_kv)));
+    o.via.map.ptr = p;
+    o.via.map.size = size;
+    v.for_each([&](const K& key, const V& value) {
+        p->key = RPCLIB_MSGPACK::object(key, o.zone);
+        p->val = RPCLIB_MSGPACK::object(value, o.zone);
+        ++p;
+    });
+}
+
+template <typename K, typename V>
+struct object_with_zone<PersistentMap<K, V>> {
+    void operator()(RPCLIB_MSGPACK::object::with_zone& o, const PersistentMap<K, V>& v) const {
+        persistent_map_object<PersistentMap<K, V>, K, V>(o, v);
+    }
+};
+
+template <typename K, typename V>
+struct object_with_zone<PersistentMapShards<K, V>> {
+    void operator()(RPCLIB_MSGPACK::object::with_zone& o, const PersistentMapShards<K, V>& v) const {
+        persistent_map_object<PersistentMapShards<K, V>, K, V>(o, v);
+    }
+};
+
+} // namespace adaptor
+} // MSGPACK_API_VERSION_NAMESPACE
+} // namespace RPCLIB_MSGPACK
+
+#endif // PERSISTENTMAP_HPP
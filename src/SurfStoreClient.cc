@@ -14,11 +14,28 @@
 #include <sys/types.h>
 #include <dirent.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <string.h>
+#include <deque>
+#include <limits>
+#include <random>
+#include <stdexcept>
 
 #include "rpc/server.h"
 #include "picosha2/picosha2.h"
 
+#include "rpc/rpc_error.h"
+
 #include "logger.hpp"
+#include "BlockBuffer.hpp"
+#include "BlockCodec.hpp"
+#include "CuckooFilter.hpp"
+#include "DirWalker.hpp"
 #include "SurfStoreTypes.hpp"
 #include "SurfStoreClient.hpp"
 
@@ -33,11 +50,49 @@ bool fileExists(const char* filename) {
     return (stat(filename, &buf) == 0);
 }
 
-const list<string> DELETED_HASHLIST = { "0" };
+static bool isRegularFile(const string& path) {
+    struct stat buf;
+    return (stat(path.c_str(), &buf) == 0 && S_ISREG(buf.st_mode));
+}
+
+// Filenames are paths relative to base_dir. Anything absolute, with empty
+// components, or with a component starting with '.' (which also rules out
+// "..", index temp files and download temp files) is never synced; this
+// keeps a bad remote entry from writing outside base_dir.
+static bool valid_sync_path(const string& path) {
+    if (path.empty() || path == "index.txt" || path == "index.txt.new") { return false; }
+    size_t start = 0;
+    while (true) {
+        size_t slash = path.find('/', start);
+        size_t len = (slash == string::npos ? path.size() : slash) - start;
+        if (len == 0 || path[start] == '.') { return false; }
+        if (slash == string::npos) { return true; }
+        start = slash + 1;
+    }
+}
+
+// create the directories leading up to base/rel
+static bool make_parent_dirs(const string& base, const string& rel) {
+    for (size_t slash = rel.find('/'); slash != string::npos; slash = rel.find('/', slash + 1)) {
+        string dir = base + "/" + rel.substr(0, slash);
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) { return false; }
+    }
+    return true;
+}
+
+// remove the directories leading up to base/rel that became empty
+static void prune_empty_parents(const string& base, const string& rel) {
+    for (size_t slash = rel.rfind('/'); slash != string::npos && slash > 0; slash = rel.rfind('/', slash - 1)) {
+        string dir = base + "/" + rel.substr(0, slash);
+        if (rmdir(dir.c_str()) != 0) { return; }
+    }
+}
 
 // constructor to set up a server using the config file 
 SurfStoreClient::SurfStoreClient(INIReader &t_config)
-    : config(t_config), c(nullptr)
+    : config(t_config), encoded_rpcs(false), codec(CODEC_NONE), c(nullptr),
+      read_rr(0), batch_commits(true), commit_first(false), wake_fd(-1), stopping(false),
+      local_index_dirty(false)
 {
     auto log = logger();
 
@@ -54,6 +109,7 @@ SurfStoreClient::SurfStoreClient(INIReader &t_config)
         log->error("Config line {} is invalid", serverconf);
         exit(EX_CONFIG);
     }
+    serveraddr = serverconf;
     serverhost = serverconf.substr(0, idx);
     serverport = strtol(serverconf.substr(idx + 1).c_str(), nullptr, 0);
     if (serverport <= 0 || serverport > 65535)
@@ -62,12 +118,104 @@ SurfStoreClient::SurfStoreClient(INIReader &t_config)
         exit(EX_CONFIG);
     }
 
+    vector<string> replicas;
+    stringstream replica_list(config.Get("ssd", "metadata_replicas", ""));
+    string replica;
+    while (getline(replica_list, replica, ','))
+    {
+        replica.erase(0, replica.find_first_not_of(" \t"));
+        replica.erase(replica.find_last_not_of(" \t") + 1);
+        if (!replica.empty()) { replicas.push_back(replica); }
+    }
+    readhost = serverhost;
+    readport = serverport;
+    if (!replicas.empty())
+    {
+        // spread the clients over the replicas
+        random_device rd;
+        readaddr = replicas[rd() % replicas.size()];
+        size_t colon = readaddr.rfind(':');
+        readhost = readaddr.substr(0, colon);
+        readport = colon == string::npos ? 0 : strtol(readaddr.substr(colon + 1).c_str(), nullptr, 0);
+        if (readport <= 0 || readport > 65535)
+        {
+            log->error("Metadata replica {} is invalid", readaddr);
+            exit(EX_CONFIG);
+        }
+    }
+
+    ring = HashRing(config.GetInteger("ssd", "virtual_nodes", HashRing::DEFAULT_VNODES));
+    stringstream block_servers(config.Get("ssd", "block_servers", ""));
+    string node;
+    while (getline(block_servers, node, ','))
+    {
+        node.erase(0, node.find_first_not_of(" \t"));
+        node.erase(node.find_last_not_of(" \t") + 1);
+        if (node.empty()) { continue; }
+        size_t colon = node.rfind(':');
+        long port = colon == string::npos ? 0 : strtol(node.substr(colon + 1).c_str(), nullptr, 0);
+        if (port <= 0 || port > 65535)
+        {
+            log->error("Block server {} is invalid", node);
+            exit(EX_CONFIG);
+        }
+        ring.add(node);
+    }
+    if (ring.empty())
+    {
+        if (config.Get("ssd", "role", "all") == "metadata")
+        {
+            log->error("The server only stores metadata ([ssd] role), list the block servers in [ssd] block_servers");
+            exit(EX_CONFIG);
+        }
+        ring.add(serveraddr);
+        // a metadata server that stores the blocks too tells at commit time
+        // which blocks it is missing (update_files)
+        commit_first = true;
+    }
+    block_replicas = config.GetInteger("ssd", "block_replicas", 1);
+    if (block_replicas < 1 || block_replicas > (int) ring.nodes().size())
+    {
+        log->error("[ssd] block_replicas must be between 1 and the number of block servers ({})", ring.nodes().size());
+        exit(EX_CONFIG);
+    }
+    string erasure_conf = config.Get("ssd", "erasure_coding", "");
+    if (!erasure_conf.empty())
+    {
+        int k, m;
+        if (!ErasureCode::parse(erasure_conf, k, m) || k + m > (int) ring.nodes().size())
+        {
+            log->error("[ssd] erasure_coding must be k+m, with k + m at most the number of block servers ({})",
+                       ring.nodes().size());
+            exit(EX_CONFIG);
+        }
+        if (block_replicas > 1)
+        {
+            log->error("Use either [ssd] block_replicas or [ssd] erasure_coding");
+            exit(EX_CONFIG);
+        }
+        erasure = ErasureCode(k, m);
+    }
+
     base_dir = config.Get("ss", "base_dir", "");
     blocksize = config.GetInteger("ss", "blocksize", 4096);
+    write_buffer = config.GetInteger("ss", "write_buffer", 1 << 20);
+    if (write_buffer < (size_t) blocksize) { write_buffer = blocksize; }
+    compression = config.GetBoolean("ss", "compression", true);
+    debounce_ms = config.GetInteger("ss", "debounce_ms", 200);
+    max_batch_delay_ms = config.GetInteger("ss", "max_batch_delay_ms", 2000);
+    full_sync_interval = config.GetInteger("ss", "full_sync_interval", 60);
+    scan_threads = config.GetInteger("ss", "scan_threads", 4);
+    sync_report = config.GetBoolean("ss", "sync_report", true);
+    trace_file = config.Get("ss", "trace_file", "");
 
     log->info("Launching SurfStore client");
     log->info("Server host: {}", serverhost);
     log->info("Server port: {}", serverport);
+    log->info("Block servers: {}, {} cop{} of each block", ring.nodes().size(), block_replicas,
+              block_replicas == 1 ? "y" : "ies");
+    if (erasure.enabled()) { log->info("Erasure coding: {}", erasure_conf); }
+    if (!readaddr.empty()) { log->info("Metadata replica: {}", readaddr); }
 
     c = new rpc::client(serverhost, serverport);
 }
@@ -89,29 +237,73 @@ SurfStoreClient::~SurfStoreClient()
     3   client no changes, server files changed, download files from the server
 */ 
 void SurfStoreClient::sync()
+{
+    do_sync(nullptr);
+}
+
+// sync only the given files (relative to base_dir), e.g. the ones the
+// daemon saw change; remote entries for other files are left alone
+void SurfStoreClient::sync(const set<string>& paths)
+{
+    do_sync(&paths);
+}
+
+void SurfStoreClient::do_sync(const set<string>* only)
 {
     auto log = logger();
+    trace.reset(!trace_file.empty());
+    server_blocks.clear();
+    counted_blocks.clear();
+    down_nodes.clear();
+    for (auto& kv : block_filters) { kv.second.checked = false; }
+    unacked.clear();
+    load_local_index();
+    // whatever was synced is recorded, also when the sync fails halfway
+    struct IndexWriter {
+        SurfStoreClient* client;
+        ~IndexWriter() { client->save_local_index(); }
+    } index_writer = { this };
+    {
+        TraceScope ts(trace, "negotiate_codec");
+        negotiate_codec();
+    }
     log->info("====== scanning local files in directory {} ======", base_dir);
 
-    DIR* dirp = opendir(base_dir.c_str());
-    struct dirent * dp;
     map<string,list<string>> newfile_hashmap, modfile_hashmap; // keep track of files there are either new or modified
 
-    // The client should first scan the base directory
-    while ((dp = readdir(dirp)) != NULL) {
-        string filename = dp->d_name;
+    // The client should first scan the base directory, including every
+    // subdirectory; filenames are paths relative to base_dir
+    vector<string> filenames;
+    {
+        TraceScope ts(trace, "scan");
+        if (only) {
+            // deleted paths are picked up below when comparing with the remote index
+            for (const string& filename : *only) {
+                if (isRegularFile(base_dir + "/" + filename)) { filenames.push_back(filename); }
+            }
+        } else {
+            filenames = walk_tree(base_dir, scan_threads);
+        }
+    }
 
+    for (const string& filename : filenames) {
         // skip index.txt and any file starting with .
-        if (filename == "index.txt" || filename[0] == '.') { continue; }
+        if (!valid_sync_path(filename)) { continue; }
 
         list<string> new_hashlist;   // create a hashlist for each file
         list<string> blocks = get_blocks_from_file(filename);
 
         // for each file, compute that file’s hash list.
         // The last buffer less than the buffer size?
-        for (const string& block : blocks) {
-            string blockhash = picosha2::hash256_hex_string(block);
-            new_hashlist.push_back(blockhash);
+        {
+            TraceScope ts(trace, "hash", filename);
+            for (const string& block : blocks) {
+                string blockhash = picosha2::hash256_hex_string(block);
+                new_hashlist.push_back(blockhash);
+                trace.add(SyncTrace::BYTES_HASHED, block.size());
+            }
+            trace.add(SyncTrace::BLOCKS_HASHED, blocks.size());
+            trace.add(SyncTrace::FILES_HASHED);
         }
 
         // The client should then consult the local index file and compare the results,
@@ -119,9 +311,9 @@ void SurfStoreClient::sync()
         // that aren’t in the index file, or (2) files that are in the index file,
         // but have changed since the last time the client was executed
         // (i.e., the hash list is different).
-        FileInfo local_index = get_local_fileinfo(filename); // consult local index file
-        int localv = get<0>(local_index);
-        list<string> local_hashlist = get<1>(local_index);
+        FileInfo local_finfo = get_local_fileinfo(filename); // consult local index file
+        int localv = get<0>(local_finfo);
+        list<string> local_hashlist = get<1>(local_finfo);
 
         if (localv == -1) { // new file do not exist in local index file or fail to open the index file
             newfile_hashmap[filename] = new_hashlist; // new files in the base directory that aren’t in the index file
@@ -132,26 +324,35 @@ void SurfStoreClient::sync()
                 modfile_hashmap[filename] = new_hashlist;
             }
         } // end if (localv == -1)
-    } // end while ((dp = readdir(dirp)) != NULL)
-    closedir(dirp);
+    } // end for (const string& filename : filenames)
     log->info("====== finish scanning local files in directory {} ======", base_dir);
 
     // Next, the client should connect to the server and download an updated FileInfoMap.
     // For the purposes of this discussion, let’s call this the “remote index.”
     log->info("====== connect to the server and download an updated FileInfoMap ======");
-    FileInfoMap remote_index = c->call("get_fileinfo_map").as<FileInfoMap>();
+    FileInfoMap remote_index = fetch_remote_index();
+
+    // Commits are queued and sent together at the end (update_files), after
+    // the blocks of every file are uploaded (with commit_first, the ones the
+    // server surely lacks; the commit reports any others it is missing).
+    FileInfoBatch commits;
 
     // The client should now compare the local index (and any changes to local
     // files not reflected in the local index) with the remote index. A few things might result.
     for(const auto& key_val : remote_index){
         //get the file name of the remote_index
         string remote_filename = key_val.first;
+        if (only && only->find(remote_filename) == only->end()) { continue; }
+        if (!valid_sync_path(remote_filename)) {
+            log->warn("Ignoring remote file with invalid name '{}'", remote_filename);
+            continue;
+        }
         FileInfo remote_fileinfo = key_val.second; // a tuple
-        FileInfo local_index = get_local_fileinfo(remote_filename); // the local fileinfo of the file name
+        FileInfo local_finfo = get_local_fileinfo(remote_filename); // the local fileinfo of the file name
         int remotev = get<0>(remote_fileinfo);
-        int localv = get<0>(local_index);
+        int localv = get<0>(local_finfo);
         list<string> remote_hashlist = get<1>(remote_fileinfo);
-        list<string> local_hashlist = get<1>(local_index); // hash list of the filename
+        list<string> local_hashlist = get<1>(local_finfo); // hash list of the filename
 
         // First, it is possible that the remote index refers to a file
         // not present in the local index or in the base directory.
@@ -165,19 +366,22 @@ void SurfStoreClient::sync()
             // locally deleted fil 
             // filename entry exists in both remote and local index
             if (!fileExists( (base_dir + "/" + remote_filename).c_str())) { 
+                if (local_hashlist == DELETED_HASHLIST) {
+                    // the deletion is already recorded in both indexes; only
+                    // pick up a newer remote version (e.g. the file came back)
+                    if (remotev > localv) {
+                        remote2local(remote_filename, remote_hashlist, remotev);
+                    }
+                    continue;
+                }
+
                 // To represent a “tombstone” record, we will set the file’s
                 // hash list to a single hash value of “0” (zero).
+                // The local index is updated once the commit succeeds;
+                // otherwise the remote version is downloaded.
                 int newv = localv + 1;
                 FileInfo new_finfo = make_tuple(newv, DELETED_HASHLIST);
-                bool success = c->call("update_file", remote_filename, new_finfo).as<bool>();
-
-                if (success) { // upload local index if delete request succcesses
-                    set_local_fileinfo(remote_filename, new_finfo);
-                } else { 
-
-                    //download
-                    remote2local(remote_filename, remote_hashlist, remotev);
-                }
+                commits.push_back(make_pair(remote_filename, new_finfo));
             }
            
             //file not modifed , remote version > local version
@@ -215,27 +419,19 @@ void SurfStoreClient::sync()
                 if (remotev == localv) { // file both exists in remote and local
                     // This means that we need to sync our local changes to the cloud.
                     list<string>& modfile_hashlist = modfile_hashmap[remote_filename];
-                    upload_data(remote_filename, modfile_hashlist);
+                    // the server has every block of the version we last synced
+                    server_blocks.insert(local_hashlist.begin(), local_hashlist.end());
+                    if (!upload_data(remote_filename, modfile_hashlist)) { continue; }
                     // The client can now update the mapping on the server
                     int newv = localv + 1;
                     FileInfo new_finfo = make_tuple(newv, modfile_hashlist);
-                    bool success = c->call("update_file", remote_filename, new_finfo).as<bool>(); // update the server with the new FileInfo.
-                    // if that RPC call completes successfully, the client can
+                    // if that commit completes successfully, the client can
                     // update the entry in the local index and is done (there is
                     // no need to modify the file’s contents in the base directory
-                    // in this case).
-                    
-                    //check if upload success, 
-
-                    if (success) { 
-                        //upload success
-                        set_local_fileinfo(remote_filename, new_finfo);
-                    }
-                    else { 
-                        // same version but different content. *conflict*
-                        remote2local(remote_filename, remote_hashlist, remotev);
-                        continue;
-                    }
+                    // in this case). If it fails, another client committed the
+                    // same version with different content first: *conflict*,
+                    // and the remote version is downloaded.
+                    commits.push_back(make_pair(remote_filename, new_finfo));
                 } // end if (remotev == localv)
 
                 // Finally, we must consider the case where there are local modifications
@@ -262,130 +458,873 @@ void SurfStoreClient::sync()
         string new_filename = kv.first;
         list<string> new_hashlist = kv.second;
 
-        log->info("upload filename {}",new_filename);
+        SS_DEBUG(log, "upload filename {}",new_filename);
         for (const string& hash:new_hashlist ) {
-            log->info("hash value is {}", hash);
+            SS_DEBUG(log, "hash value is {}", hash);
         }
 
         // The client should upload the blocks corresponding to this file to the server,
-        // then update the server with the new FileInfo.
-        upload_data(new_filename, new_hashlist);
+        // then update the server with the new FileInfo (with commit_first, the
+        // blocks the server may have are only sent if it reports them
+        // missing at the commit).
+        if (!upload_data(new_filename, new_hashlist)) { continue; }
 
         // To create a file that has never existed, use the update\_file() API call with a version number set to 1.
         FileInfo new_finfo = make_tuple(1, new_hashlist);
-        bool success = c->call("update_file", new_filename, new_finfo).as<bool>(); // update the server with the new FileInfo.
+        commits.push_back(make_pair(new_filename, new_finfo));
+    } // end for (auto const& kv : newfile_hashmap)
 
+    log->info("====== committing {} files ======", commits.size());
+    vector<CommitResult> committed = commit_fileinfos(commits);
+    bool primary_fetched = false;
+    for (size_t i = 0; i < commits.size(); i++) {
+        const string& filename = commits[i].first;
         // If that update is successful, then the client should update its local index.
-        if (success) { set_local_fileinfo(new_filename, new_finfo); }
-        else {
-            // Note it is possible that while this operation is in progress,
-            // some other client makes it to the server first, and creates the file
-            // first. In that case, the update\_file() operation will fail
-            // with a version error, and the client should handle this conflict
-            // as described in the next section.
-            remote_index = c->call("get_fileinfo_map").as<FileInfoMap>();
-            FileInfo remote_overwrite_finfo = remote_index[new_filename];
-            remote2local(new_filename, get<1>(remote_overwrite_finfo), get<0>(remote_overwrite_finfo)); // TODO: check this out!
-        } // end if (success)
-    } // end for (auto const& kv : newfile_hashmap)
+        if (get<0>(committed[i])) {
+            set_local_fileinfo(filename, commits[i].second);
+            continue;
+        }
+        if (!get<1>(committed[i]).empty()) {
+            // not a conflict: the local changes are committed on the next sync
+            log->error("Cannot commit {}: {} of its blocks did not reach the server", filename,
+                       get<1>(committed[i]).size());
+            continue;
+        }
+        // Note it is possible that while this operation is in progress,
+        // some other client makes it to the server first, and creates or
+        // changes the file first. In that case, the update\_file() operation
+        // will fail with a version error, and the client should handle this
+        // conflict as described in the next section.
+        // The winning version is looked up on the primary: the index fetched
+        // above may come from a replica that has not seen it yet.
+        if (!primary_fetched) {
+            remote_index = fetch_remote_index(true);
+            primary_fetched = true;
+        }
+        auto lost = remote_index.find(filename);
+        if (lost == remote_index.end()) {
+            log->error("Commit of {} failed but the server has no entry for it", filename);
+            continue;
+        }
+        remote2local(filename, get<1>(lost->second), get<0>(lost->second));
+    }
+    save_local_index();
+
+    if (sync_report) { trace.log_summary(); }
+    if (!trace_file.empty() && !trace.write_chrome_trace(trace_file)) {
+        log->error("Cannot write trace file {}", trace_file);
+    }
+}
+
+// (re)connect to the server, e.g. after it was restarted under the daemon
+void SurfStoreClient::reconnect()
+{
+    if (c) { delete c; }
+    c = new rpc::client(serverhost, serverport);
+    block_clients.clear();
+    rc.reset();
+    encoded_rpcs = false; // the new server may speak a different protocol
+    batch_commits = true;
+    block_filters.clear();
 }
 
-FileInfo SurfStoreClient::get_local_fileinfo(string filename)
+// Connection to the metadata replica. rpclib waits forever for a connection
+// that was refused and for answers on a connection that was closed, so a
+// new one must answer a ping within REPLICA_CONNECT_MS first and a closed
+// one is replaced.
+rpc::client& SurfStoreClient::replica()
+{
+    if (rc && rc->get_connection_state() != rpc::client::connection_state::connected) { rc.reset(); }
+    if (!rc) {
+        rc.reset(new rpc::client(readhost, readport));
+        rc->set_timeout(REPLICA_CONNECT_MS);
+        rc->call("ping");
+        rc->set_timeout(REPLICA_TIMEOUT_MS);
+    }
+    return *rc;
+}
+
+// download the remote index, from the metadata replica if there is one
+FileInfoMap SurfStoreClient::fetch_remote_index(bool from_primary)
+{
+    TraceScope ts(trace, "get_fileinfo_map");
+    if (!from_primary && !readaddr.empty() && chrono::steady_clock::now() >= replica_retry) {
+        try {
+            return replica().call("get_fileinfo_map").as<FileInfoMap>();
+        } catch (exception &e) {
+            auto log = logger();
+            SS_RATE_LIMITED(log, spdlog::level::warn, "Metadata replica {} failed ({}), reading from the primary",
+                            readaddr, e.what());
+            rc.reset();
+            replica_retry = chrono::steady_clock::now() + chrono::seconds(REPLICA_RETRY_S);
+        }
+    }
+    return c->call("get_fileinfo_map").as<FileInfoMap>();
+}
+
+// update_file() on the server; false if another client got there first
+bool SurfStoreClient::commit_fileinfo(const string& filename, const FileInfo& finfo)
+{
+    TraceScope ts(trace, "update_file", filename);
+    return c->call("update_file", filename, finfo).as<bool>();
+}
+
+// Commit a batch of FileInfos with as few update_files() calls as the
+// batch's size allows. With commit_first the blocks are not uploaded yet:
+// the server answers which ones it is missing, those are uploaded and the
+// files committed again, for up to COMMIT_ROUNDS calls. Servers that
+// predate update_files() get one update_file() per file, after the
+// upload. Returns (committed, missing) for each entry; missing is only
+// left non-empty if the blocks could not be stored.
+vector<CommitResult> SurfStoreClient::commit_fileinfos(const FileInfoBatch& batch)
 {
     auto log = logger();
-    log->info("get_local_fileinfo {}", filename);
-    ifstream f(base_dir + "/index.txt");
-    if (f.fail())
-    {
-        int v = -1;
-        list<string> blocklist;
-        FileInfo ret = make_tuple(v, list<string>());
-        return ret;
+    vector<CommitResult> results(batch.size(), CommitResult(false, list<string>()));
+    vector<size_t> pending;
+    for (size_t k = 0; k < batch.size(); k++) { pending.push_back(k); }
+
+    for (int round = 1; !pending.empty() && batch_commits; round++) {
+        vector<size_t> retry;
+        size_t next = 0;
+        while (next < pending.size()) {
+            // at least one file per call, however long its hash list
+            FileInfoBatch chunk;
+            size_t hashes = 0;
+            do {
+                hashes += get<1>(batch[pending[next + chunk.size()]].second).size();
+                chunk.push_back(batch[pending[next + chunk.size()]]);
+            } while (next + chunk.size() < pending.size() &&
+                     hashes + get<1>(batch[pending[next + chunk.size()]].second).size() <= COMMIT_BATCH_HASHES);
+
+            vector<CommitResult> ret;
+            try {
+                TraceScope ts(trace, "update_files");
+                ret = c->call("update_files", chunk).as<vector<CommitResult>>();
+            } catch (rpc::rpc_error &e) {
+                log->info("Server does not support update_files, committing one file at a time");
+                batch_commits = false;
+                break;
+            }
+            if (ret.size() != chunk.size()) {
+                throw runtime_error("update_files returned " + to_string(ret.size()) + " results for " +
+                                    to_string(chunk.size()) + " files");
+            }
+            for (size_t i = 0; i < ret.size(); i++) {
+                size_t k = pending[next + i];
+                results[k] = ret[i];
+                const list<string>& missing = get<1>(ret[i]);
+                if (commit_first && get<1>(batch[k].second) != DELETED_HASHLIST) {
+                    // the server has every other block: those not uploaded are dedup hits
+                    set<string> lacking(missing.begin(), missing.end());
+                    for (const string& hash : get<1>(batch[k].second)) {
+                        if (!lacking.count(hash)) { count_dedup_hit(hash); }
+                    }
+                }
+                if (get<0>(ret[i]) || missing.empty() || round == COMMIT_ROUNDS) { continue; }
+                // the server knows best, whatever we assumed it has
+                set<string> upload(missing.begin(), missing.end());
+                for (const string& hash : missing) { server_blocks.erase(hash); }
+                // if the file changed, results[k] keeps the missing blocks:
+                // not a conflict, the next sync commits the new content
+                if (!upload_data(batch[k].first, get<1>(batch[k].second), &upload)) { continue; }
+                retry.push_back(k);
+            }
+            next += chunk.size();
+        }
+        // entries not sent yet if the server turned out not to know update_files
+        retry.insert(retry.end(), pending.begin() + next, pending.end());
+        pending = retry;
     }
-    do
-    {
-        vector<string> parts;
-        string x;
-        getline(f, x);
-        stringstream ss(x);
-        string tok;
-        while (getline(ss, tok, ' '))
-        {
-            parts.push_back(tok);
+    for (size_t k : pending) {
+        if (commit_first && get<1>(batch[k].second) != DELETED_HASHLIST) {
+            // what was left to the commit to check
+            set<string> all(get<1>(batch[k].second).begin(), get<1>(batch[k].second).end());
+            if (!upload_data(batch[k].first, get<1>(batch[k].second), &all)) {
+                results[k] = CommitResult(false, get<1>(batch[k].second));
+                continue;
+            }
+        }
+        try {
+            get<0>(results[k]) = commit_fileinfo(batch[k].first, batch[k].second);
+        } catch (rpc::rpc_error &e) {
+            // blocks are missing, not a conflict: report the hash list
+            // (the server does not say which) so the file is not downloaded
+            const RPCLIB_MSGPACK::object& err = e.get_error().get();
+            if (err.type != RPCLIB_MSGPACK::type::STR || err.as<string>().compare(0, MISSING_BLOCKS_ERROR.size(), MISSING_BLOCKS_ERROR) != 0) {
+                throw;
+            }
+            results[k] = CommitResult(false, get<1>(batch[k].second));
+        }
+    }
+    return results;
+}
+
+// Long-poll the server for commits made by other clients and hand the
+// changed filenames to the daemon's main loop. Runs on its own thread with
+// its own connection so a parked call never delays a sync. Polls the
+// metadata replica if there is one, and the primary once the replica fails.
+void SurfStoreClient::watch_remote()
+{
+    auto log = logger();
+    typedef tuple<uint64_t, FileInfoMap> Changes;
+    bool on_replica = !readaddr.empty();
+    unique_ptr<rpc::client> wc;
+    // a replica that is down only shows up as a timeout, so keep it short
+    // until the replica answered once
+    auto connect = [&]() {
+        wc.reset(on_replica ? new rpc::client(readhost, readport) : new rpc::client(serverhost, serverport));
+        wc->set_timeout(on_replica ? REPLICA_CONNECT_MS : WATCH_TIMEOUT_MS + 10000);
+    };
+    auto use_primary = [&](const exception& e) {
+        log->warn("Metadata replica {} failed ({}), watching the primary", readaddr, e.what());
+        on_replica = false;
+        connect();
+    };
+    connect();
+
+    uint64_t since;
+    while (true) {
+        try {
+            // timeout 0: just learn the current epoch, the initial full sync
+            // takes care of everything before it
+            since = get<0>(wc->call("wait_for_changes", (uint64_t) 0, 0).as<Changes>());
+            wc->set_timeout(WATCH_TIMEOUT_MS + 10000);
+            break;
+        } catch (rpc::rpc_error &e) {
+            log->info("Server does not support wait_for_changes, relying on periodic full syncs");
+            return;
+        } catch (exception &e) {
+            if (on_replica) { use_primary(e); continue; }
+            log->error("Cannot start watching the server: {}", e.what());
+            return;
+        }
+    }
+
+    // a server with no room to park us answers at once with nothing; wait
+    // before asking again, longer each time, instead of spinning
+    int backoff_ms = 0;
+    while (!stopping) {
+        Changes changes;
+        auto start = chrono::steady_clock::now();
+        try {
+            changes = wc->call("wait_for_changes", since, WATCH_TIMEOUT_MS).as<Changes>();
+        } catch (exception &e) {
+            if (on_replica) {
+                // the replica's epochs mean nothing to the primary: an epoch
+                // from the future gets every file
+                use_primary(e);
+                since = numeric_limits<uint64_t>::max();
+                continue;
+            }
+            log->error("wait_for_changes failed: {}", e.what());
+            this_thread::sleep_for(chrono::seconds(1));
+            connect();
+            continue;
         }
-        if (parts.size() > 0 && parts[0] == filename)
+
+        since = get<0>(changes);
+        if (get<1>(changes).empty()) {
+            if (chrono::steady_clock::now() - start < chrono::milliseconds(100)) {
+                backoff_ms = min(max(2 * backoff_ms, 100), 5000);
+                this_thread::sleep_for(chrono::milliseconds(backoff_ms));
+            } else {
+                backoff_ms = 0;
+            }
+            continue;
+        }
+        backoff_ms = 0;
+
         {
-            list<string> hl(parts.begin() + 2, parts.end());
-            int v = stoi(parts[1]);
-            return make_tuple(v, hl);
+            lock_guard<mutex> lock(remote_mtx);
+            for (const auto& kv : get<1>(changes)) { remote_changes.insert(kv.first); }
+        }
+        uint64_t one = 1;
+        if (write(wake_fd, &one, sizeof(one)) != sizeof(one)) {
+            log->error("Cannot wake up the sync loop: {}", strerror(errno));
         }
-    } while (!f.eof());
-    int v = -1;
-    list<string> blocklist;
-    FileInfo ret = make_tuple(v, list<string>());
-    return ret;
+    }
 }
 
-void SurfStoreClient::set_local_fileinfo(string filename, FileInfo finfo)
+// Daemon mode: keep the connection open, learn about local changes through
+// inotify and sync just the files that changed. Bursts of events are
+// debounced: a batch is synced once base_dir has been quiet for debounce_ms,
+// or at the latest max_batch_delay_ms after its first event. Commits by
+// other clients arrive through watch_remote() and are synced right away; a
+// full sync still runs every full_sync_interval seconds as a safety net.
+void SurfStoreClient::watch()
 {
     auto log = logger();
-    log->info("set local file info");
-    std::ifstream f(base_dir + "/index.txt");
-    std::ofstream out(base_dir + "/index.txt.new");
-    int v = get<0>(finfo);
-    list<string> hl = get<1>(finfo);
-    bool set = false;
-    do
-    {
-        string x;
+    typedef chrono::steady_clock clock;
+
+    const uint32_t WATCH_MASK = IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE |
+                                IN_DELETE | IN_DELETE_SELF | IN_MOVE_SELF;
+    map<int, string> watched; // watch descriptor -> directory relative to base_dir
+    set<string> pending;
+
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    int root_wd = fd < 0 ? -1 : inotify_add_watch(fd, base_dir.c_str(), WATCH_MASK);
+    if (root_wd < 0) {
+        log->error("Cannot watch directory {}: {}", base_dir, strerror(errno));
+        exit(EX_OSERR);
+    }
+
+    // inotify is not recursive: watch every directory below rel as well and
+    // queue the files already in it (they may have been moved in as a whole).
+    // A directory may gain entries between being read and being watched, so
+    // rel is walked again until no new directories turn up: by then every
+    // file was either found by a walk or is reported by inotify.
+    auto add_watches = [&](const string& rel) {
+        string root = rel.empty() ? base_dir : base_dir + "/" + rel;
+        string prefix = rel.empty() ? "" : rel + "/";
+        set<string> seen;
+        bool found_new = true;
+        while (found_new) {
+            found_new = false;
+            vector<string> dirs;
+            vector<string> files = walk_tree(root, scan_threads, &dirs);
+            for (const string& dir : dirs) {
+                if (!seen.insert(dir).second || (rel.empty() && dir.empty())) { continue; }
+                found_new = true;
+                string path = dir.empty() ? rel : prefix + dir;
+                int wd = inotify_add_watch(fd, (base_dir + "/" + path).c_str(), WATCH_MASK);
+                if (wd < 0) {
+                    log->error("Cannot watch directory {}: {}", path, strerror(errno));
+                    continue;
+                }
+                watched[wd] = path;
+            }
+            if (!rel.empty()) {
+                for (const string& file : files) { pending.insert(prefix + file); }
+            }
+        }
+    };
+    watched[root_wd] = "";
+    add_watches("");
+
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd < 0) {
+        log->error("Cannot create eventfd: {}", strerror(errno));
+        exit(EX_OSERR);
+    }
+    log->info("Watching {} for changes", base_dir);
+    thread remote_watcher(&SurfStoreClient::watch_remote, this);
+
+    bool need_full = true; // start with a full sync to catch up
+    bool remote_due = false; // pending holds remote changes, sync without debouncing
+    clock::time_point first_event, last_event;
+    clock::time_point next_full = clock::now();
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    while (true) {
+        clock::time_point now = clock::now();
+
+        // run whatever sync is due
+        if (need_full || (full_sync_interval > 0 && now >= next_full) ||
+            (!pending.empty() && (remote_due ||
+                                  now - last_event >= chrono::milliseconds(debounce_ms) ||
+                                  now - first_event >= chrono::milliseconds(max_batch_delay_ms)))) {
+            try {
+                if (need_full || (full_sync_interval > 0 && now >= next_full)) {
+                    sync();
+                    next_full = clock::now() + chrono::seconds(full_sync_interval);
+                } else {
+                    log->info("Syncing {} changed file(s)", pending.size());
+                    sync(pending);
+                }
+                need_full = false;
+                remote_due = false;
+                pending.clear();
+            } catch (exception &e) {
+                // retry with a full sync once the server is reachable again
+                log->error("Sync failed: {}", e.what());
+                reconnect();
+                this_thread::sleep_for(chrono::seconds(1));
+                need_full = true;
+                continue;
+            }
+            now = clock::now();
+        }
+
+        // sleep until the next event or the next deadline
+        long timeout = -1;
+        if (full_sync_interval > 0) {
+            timeout = chrono::duration_cast<chrono::milliseconds>(next_full - now).count();
+        }
+        if (!pending.empty()) {
+            long quiet = chrono::duration_cast<chrono::milliseconds>(
+                last_event + chrono::milliseconds(debounce_ms) - now).count();
+            long cap = chrono::duration_cast<chrono::milliseconds>(
+                first_event + chrono::milliseconds(max_batch_delay_ms) - now).count();
+            long due = quiet < cap ? quiet : cap;
+            timeout = (timeout < 0 || due < timeout) ? due : timeout;
+        }
+        struct pollfd pfds[2] = { { fd, POLLIN, 0 }, { wake_fd, POLLIN, 0 } };
+        if (poll(pfds, 2, timeout < 0 ? -1 : (int) timeout) <= 0) { continue; }
+
+        if (pfds[1].revents & POLLIN) {
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof(count)) == sizeof(count)) {
+                lock_guard<mutex> lock(remote_mtx);
+                if (!remote_changes.empty()) {
+                    if (pending.empty()) { first_event = clock::now(); }
+                    last_event = clock::now();
+                    pending.insert(remote_changes.begin(), remote_changes.end());
+                    remote_changes.clear();
+                    remote_due = true;
+                }
+            }
+        }
+
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof(buf))) > 0) {
+            for (char* p = buf; p < buf + len; ) {
+                struct inotify_event* ev = (struct inotify_event*) p;
+                p += sizeof(struct inotify_event) + ev->len;
+
+                if (ev->wd == root_wd && (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF))) {
+                    log->error("Directory {} went away, stopping", base_dir);
+                    stopping = true;
+                    remote_watcher.join();
+                    close(fd);
+                    close(wake_fd);
+                    return;
+                }
+                if (ev->mask & IN_IGNORED) { // a subdirectory was removed
+                    watched.erase(ev->wd);
+                    continue;
+                }
+                if (ev->mask & IN_Q_OVERFLOW) { // events were dropped
+                    need_full = true;
+                    continue;
+                }
+                if (ev->len == 0 || ev->name[0] == '.' || watched.find(ev->wd) == watched.end()) { continue; }
+
+                const string& dir = watched[ev->wd];
+                string filename = dir.empty() ? string(ev->name) : dir + "/" + ev->name;
+                if (filename == "index.txt" || filename == "index.txt.new") { continue; }
+
+                if (ev->mask & IN_ISDIR) {
+                    if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                        bool was_empty = pending.empty();
+                        add_watches(filename);
+                        last_event = clock::now();
+                        if (was_empty) { first_event = last_event; }
+                    } else if (ev->mask & IN_MOVED_FROM) {
+                        // every file below it is gone, but we do not know
+                        // their names any more
+                        need_full = true;
+                    }
+                    continue;
+                }
+                if (ev->mask & IN_CREATE) { continue; } // wait for IN_CLOSE_WRITE
+
+                last_event = clock::now();
+                if (pending.empty()) { first_event = last_event; }
+                pending.insert(filename);
+            }
+        }
+    }
+}
+
+// Ask the server which block codecs it understands. Servers that predate
+// block encoding do not know get_codecs(), in which case we keep using the
+// plain store_block/get_block calls.
+void SurfStoreClient::negotiate_codec()
+{
+    auto log = logger();
+    if (encoded_rpcs) { return; }
+
+    // blocks may go to any block server, so only use what all of them support
+    bool lz = compression;
+    try {
+        for (const string& node : ring.nodes()) {
+            list<int> server_codecs;
+            try {
+                server_codecs = block_node(node).call("get_codecs").as<list<int>>();
+            } catch (rpc::rpc_error &e) {
+                throw;
+            } catch (exception &e) {
+                // without copies of its blocks elsewhere a server that is
+                // down fails the sync
+                if (block_replicas == 1 && !erasure.enabled()) { throw; }
+                node_failed(node, e);
+                continue;
+            }
+            if (find(server_codecs.begin(), server_codecs.end(), (int) CODEC_LZ) == server_codecs.end()) {
+                lz = false;
+            }
+        }
+    } catch (rpc::rpc_error &e) {
+        log->info("Server does not support block encoding, sending raw blocks");
+        return;
+    }
+
+    encoded_rpcs = true;
+    codec = lz ? CODEC_LZ : CODEC_NONE;
+    log->info("Negotiated block codec {}", codec);
+}
+
+// Fetch one block and return its raw bytes, or "" if the server does not
+// have it (or sent something we cannot decode)
+string SurfStoreClient::download_block(const string& hash)
+{
+    TraceScope ts(trace, "download");
+    if (erasure.enabled()) {
+        string raw = download_fragments(hash);
+        if (!raw.empty()) {
+            trace.add(SyncTrace::BLOCKS_DOWNLOADED);
+            trace.add(SyncTrace::BYTES_DOWNLOADED, raw.size());
+            return raw;
+        }
+        // blocks stored before erasure coding was turned on are whole
+    }
+
+    // the block normally is on its owner and the next block_replicas - 1
+    // nodes, which take turns serving it; blocks not yet moved after a
+    // block server joined are still on one of the nodes after them
+    vector<string> nodes = ring.successors(hash);
+    size_t copies = min(nodes.size(), (size_t) block_replicas);
+    if (copies > 1) { rotate(nodes.begin(), nodes.begin() + read_rr++ % copies, nodes.begin() + copies); }
+    for (const string& node : nodes) {
+        if (down_nodes.count(node)) { continue; }
+        string raw;
+        try {
+            raw = download_block_from(block_node(node), hash);
+        } catch (rpc::rpc_error &e) {
+            throw;
+        } catch (exception &e) {
+            node_failed(node, e);
+            continue;
+        }
+        if (!raw.empty()) {
+            trace.add(SyncTrace::BLOCKS_DOWNLOADED);
+            trace.add(SyncTrace::BYTES_DOWNLOADED, raw.size());
+            return raw;
+        }
+    }
+    return string("");
+}
+
+// fragment i of an erasure-coded block
+static string fragment_key(const string& hash, size_t i)
+{
+    return hash + "#" + to_string(i);
+}
+
+// Erasure coding: fetch the data fragments from their servers in parallel
+// and, in place of those that are missing, parity fragments until k are at
+// hand; "" if fewer than k can be had
+string SurfStoreClient::download_fragments(const string& hash)
+{
+    vector<string> nodes = ring.successors(hash);
+    int k = erasure.data_fragments();
+    int n = erasure.fragments();
+    map<int, string> fragments;
+    int next = 0;
+    while ((int) fragments.size() < k && next < n) {
+        vector<pair<int, future<RPCLIB_MSGPACK::object_handle>>> calls;
+        while ((int) (fragments.size() + calls.size()) < k && next < n) {
+            int i = next++;
+            if (down_nodes.count(nodes[i])) { continue; }
+            try {
+                calls.push_back(make_pair(i, block_node(nodes[i]).async_call("get_encoded_block", fragment_key(hash, i))));
+            } catch (rpc::rpc_error &e) {
+                throw;
+            } catch (exception &e) {
+                node_failed(nodes[i], e);
+            }
+        }
+        for (auto& call : calls) {
+            string encoded, fragment;
+            try {
+                if (call.second.wait_for(chrono::milliseconds(BLOCK_TIMEOUT_MS)) != future_status::ready) {
+                    throw runtime_error("timed out");
+                }
+                encoded = call.second.get().as<string>();
+            } catch (rpc::rpc_error &e) {
+                throw;
+            } catch (exception &e) {
+                node_failed(nodes[call.first], e);
+                continue;
+            }
+            if (!encoded.empty() && decode_block(encoded, fragment)) { fragments[call.first] = fragment; }
+        }
+    }
+
+    string encoded, raw;
+    if (!erasure.decode(fragments, encoded) || !decode_block(encoded, raw)) { return string(""); }
+    return raw;
+}
+
+string SurfStoreClient::download_block_from(rpc::client& bc, const string& hash)
+{
+    if (!encoded_rpcs) {
+        return bc.call("get_block", hash).as<string>();
+    }
+
+    string encoded = bc.call("get_encoded_block", hash).as<string>();
+    string raw;
+    if (encoded.empty() || !decode_block(encoded, raw)) {
+        return string("");
+    }
+    return raw;
+}
+
+// connection to a block server; the metadata connection is reused when
+// the metadata server stores blocks as well
+rpc::client& SurfStoreClient::block_node(const string& node)
+{
+    if (node == serveraddr) { return *c; }
+    unique_ptr<rpc::client>& bc = block_clients[node];
+    if (!bc) {
+        size_t colon = node.rfind(':');
+        bc.reset(new rpc::client(node.substr(0, colon), strtol(node.substr(colon + 1).c_str(), nullptr, 0)));
+        bc->set_timeout(BLOCK_TIMEOUT_MS);
+    }
+    return *bc;
+}
+
+// a block server did not answer: skip it for the rest of the sync and
+// connect afresh next time
+void SurfStoreClient::node_failed(const string& node, const exception& e)
+{
+    auto log = logger();
+    SS_RATE_LIMITED(log, spdlog::level::warn, "Block server {} failed ({}), skipping it", node, e.what());
+    down_nodes.insert(node);
+    block_clients.erase(node);
+}
+
+// Start storing one raw block, compressing it first if a codec was
+// negotiated. With [ssd] block_replicas > 1 the block goes to the head of
+// its chain (its owner and the following nodes of the ring), which stores
+// it and passes it on; the tail is asked later, see confirm_chains().
+// Servers of the chain that are down are left out.
+void SurfStoreClient::upload_block(const string& hash, const string& block, Uploads& inflight)
+{
+    auto log = logger();
+    TraceScope ts(trace, "upload");
+    trace.add(SyncTrace::BLOCKS_UPLOADED);
+    trace.add(SyncTrace::BYTES_UPLOADED, block.size());
+    if (!encoded_rpcs) {
+        inflight.push_back(make_pair(hash, block_node(ring.owner(hash)).async_call("store_block", hash, block)));
+        return;
+    }
+    if (erasure.enabled()) {
+        upload_fragments(hash, encode_block(block, codec), inflight);
+        return;
+    }
+    if (block_replicas == 1) {
+        inflight.push_back(make_pair(hash, block_node(ring.owner(hash)).async_call("store_encoded_block", hash,
+                                                                                  BlockRef(encode_block(block, codec)))));
+        return;
+    }
+
+    vector<string> successors = ring.successors(hash);
+    list<string> chain;
+    for (int i = 0; i < block_replicas; i++) {
+        if (!down_nodes.count(successors[i])) { chain.push_back(successors[i]); }
+    }
+    BlockRef encoded(encode_block(block, codec));
+    while (!chain.empty()) {
+        string head = chain.front();
+        chain.pop_front();
+        try {
+            // a server that is down shows up here, while connecting
+            inflight.push_back(make_pair(hash, block_node(head).async_call("store_chain", hash, encoded, chain)));
+            if ((int) chain.size() + 1 < block_replicas) {
+                SS_RATE_LIMITED(log, spdlog::level::warn, "Block {} is stored on fewer than {} block servers",
+                                hash, block_replicas);
+            }
+            if (!chain.empty()) { unacked[chain.back()].push_back(hash); }
+            return;
+        } catch (rpc::rpc_error &e) {
+            throw;
+        } catch (exception &e) {
+            node_failed(head, e);
+        }
+    }
+    throw runtime_error("every block server of the chain of block " + hash + " is down");
+}
+
+// Erasure coding: fragment i of the encoded block is stored as "hash#i" on
+// the i-th node of the ring from the block's position. Servers that are
+// down are skipped as long as k fragments can still be stored.
+void SurfStoreClient::upload_fragments(const string& hash, const string& encoded, Uploads& inflight)
+{
+    auto log = logger();
+    vector<string> fragments = erasure.encode(encoded);
+    vector<string> nodes = ring.successors(hash);
+    int stored = 0;
+    for (size_t i = 0; i < fragments.size(); i++) {
+        if (down_nodes.count(nodes[i])) { continue; }
+        string key = fragment_key(hash, i);
+        try {
+            inflight.push_back(make_pair(key, block_node(nodes[i]).async_call("store_encoded_block", key,
+                                                                             BlockRef(encode_block(fragments[i], CODEC_NONE)))));
+            stored++;
+        } catch (rpc::rpc_error &e) {
+            throw;
+        } catch (exception &e) {
+            node_failed(nodes[i], e);
+        }
+    }
+    if (stored < erasure.data_fragments()) {
+        throw runtime_error("too few block servers are up to store block " + hash);
+    }
+    if (stored < erasure.fragments()) {
+        SS_RATE_LIMITED(log, spdlog::level::warn, "Block {}: only {} of {} fragments stored",
+                        hash, stored, erasure.fragments());
+    }
+}
+
+// The block filter of the server a block goes to (get_block_filter), or
+// nullptr if there is none to use: blocks kept on several servers need
+// every copy, which one server's filter cannot tell, and older servers do
+// not export one. Each server's filter is brought up to date once per
+// sync, by its version, and kept for the next syncs.
+const CuckooFilter* SurfStoreClient::block_filter(const string& hash)
+{
+    auto log = logger();
+    if (block_replicas > 1 || erasure.enabled()) { return nullptr; }
+    string node = ring.owner(hash);
+    BlockFilter& bf = block_filters[node];
+    if (!bf.checked) {
+        bf.checked = true;
+        try {
+            TraceScope ts(trace, "get_block_filter");
+            tuple<uint64_t, string> ret = block_node(node).call("get_block_filter", bf.version).as<tuple<uint64_t, string>>();
+            if (get<0>(ret) != bf.version) {
+                unique_ptr<CuckooFilter> filter(new CuckooFilter(1));
+                if (filter->from_words(get<1>(ret))) {
+                    bf.filter = move(filter);
+                    bf.version = get<0>(ret);
+                } else {
+                    log->warn("Block filter of {} is invalid, not using it", node);
+                    bf.filter.reset();
+                    bf.version = 0;
+                }
+            }
+        } catch (rpc::rpc_error &e) {
+            SS_DEBUG(log, "{} does not export a block filter", node);
+            bf.filter.reset();
+            bf.version = 0;
+        }
+    }
+    return bf.filter.get();
+}
+
+// Chain replication: the tail of a chain is the last server to store a
+// block, so once the tails have every block sent down a chain, all servers
+// of those chains do. Blocks still missing after CHAIN_ACK_MS are reported.
+void SurfStoreClient::confirm_chains()
+{
+    auto log = logger();
+    if (unacked.empty()) { return; }
+    TraceScope ts(trace, "replicate");
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(CHAIN_ACK_MS);
+    int delay_ms = 1;
+    while (true) {
+        for (auto it = unacked.begin(); it != unacked.end(); ) {
+            try {
+                it->second = block_node(it->first).call("missing_blocks", it->second).as<list<string>>();
+            } catch (rpc::rpc_error &e) {
+                throw;
+            } catch (exception &e) {
+                node_failed(it->first, e);
+                SS_RATE_LIMITED(log, spdlog::level::warn, "{} blocks are stored on fewer than {} block servers",
+                                it->second.size(), block_replicas);
+                it->second.clear();
+            }
+            if (it->second.empty()) { it = unacked.erase(it); } else { ++it; }
+        }
+        if (unacked.empty()) { return; }
+
+        if (chrono::steady_clock::now() >= deadline) {
+            for (const auto& kv : unacked) {
+                SS_RATE_LIMITED(log, spdlog::level::warn, "{} blocks did not reach {}, they are stored on fewer than {} block servers",
+                                kv.second.size(), kv.first, block_replicas);
+            }
+            unacked.clear();
+            return;
+        }
+        this_thread::sleep_for(chrono::milliseconds(delay_ms));
+        delay_ms = min(delay_ms * 2, 100);
+    }
+}
+
+// The local index is read into local_index once at the start of a sync and
+// written back once at its end (save_local_index), not per file.
+void SurfStoreClient::load_local_index()
+{
+    auto log = logger();
+    TraceScope ts(trace, "index_read");
+    local_index.clear();
+    local_index_dirty = false;
+    ifstream f(base_dir + "/index.txt");
+    string x;
+    while (getline(f, x)) {
         vector<string> parts;
-        getline(f, x);
         stringstream ss(x);
         string tok;
-        while (getline(ss, tok, ' '))
-        {
+        while (getline(ss, tok, ' ')) {
             parts.push_back(tok);
         }
-        if (parts.size() > 0)
-        {
-            if (parts[0] == filename)
-            {
-                set = true;
-                out << filename << " " << v << " ";
-                for (auto it : hl)
-                    out << it << " ";
-                out.seekp(-1, ios_base::cur);
-                out << "\n";
-            }
-            else
-            {
-                out << x << "\n";
-            }
+        if (parts.size() < 2) { continue; }
+        list<string> hl(parts.begin() + 2, parts.end());
+        local_index[parts[0]] = make_tuple(stoi(parts[1]), hl);
+    }
+    SS_DEBUG(log, "loaded {} local index entries", local_index.size());
+}
+
+void SurfStoreClient::save_local_index()
+{
+    if (!local_index_dirty) { return; }
+    auto log = logger();
+    TraceScope ts(trace, "index_write");
+    string real = string(base_dir + "/index.txt");
+    string bkp = string(base_dir + "/index.txt.new");
+    ofstream out(bkp);
+    for (const auto& kv : local_index) {
+        out << kv.first << " " << get<0>(kv.second);
+        for (const string& hash : get<1>(kv.second)) {
+            out << " " << hash;
         }
-        else
-            break;
-    } while (!f.eof());
-    if (!set)
-    {
-        out << filename << " " << v << " ";
-        for (auto it : hl)
-            out << it << " ";
-        out.seekp(-1, ios_base::cur);
         out << "\n";
     }
     out.close();
-    f.close();
-    string real = string(base_dir + "/index.txt");
-    string bkp = string(base_dir + "/index.txt.new");
+    if (out.fail() || rename(bkp.c_str(), real.c_str()) != 0) {
+        log->error("Cannot write the local index {}: {}", real, strerror(errno));
+        return;
+    }
+    local_index_dirty = false;
+}
+
+FileInfo SurfStoreClient::get_local_fileinfo(const string& filename)
+{
+    auto it = local_index.find(filename);
+    if (it == local_index.end()) { return make_tuple(-1, list<string>()); }
+    return it->second;
+}
+
+void SurfStoreClient::set_local_fileinfo(const string& filename, const FileInfo& finfo)
+{
+    SS_DEBUG(logger(), "set local file info {}", filename);
+    local_index[filename] = finfo;
+    local_index_dirty = true;
+}
 
-    remove(real.c_str());
-    rename(bkp.c_str(), real.c_str());
+// a block not uploaded because the server has it; each hash counts once
+// per sync, however many files or commit rounds skip it
+void SurfStoreClient::count_dedup_hit(const string& hash)
+{
+    if (counted_blocks.insert(hash).second) { trace.add(SyncTrace::DEDUP_HITS); }
 }
 
 //Get the data blocks from the file given by filename
 list<string> SurfStoreClient::get_blocks_from_file(string filename) {
     auto log = logger();
-    log->info("getting data blocks from file '{}'", filename);
+    SS_DEBUG(log, "getting data blocks from file '{}'", filename);
+    TraceScope ts(trace, "read", filename);
 
     list<string> blocks;
     ifstream is(base_dir+ "/" + filename, ifstream::binary); // read in file content
@@ -400,79 +1339,244 @@ list<string> SurfStoreClient::get_blocks_from_file(string filename) {
 
     while (!is.eof()) {
         is.read(blockbuffer, blocksize); // only read in next blocksize bytes for each block
+        // no empty block at the end of a file that is a multiple of blocksize
+        // (or for an empty file): the server answers "" for missing blocks
+        if (is.gcount() == 0) { break; }
         string block(blockbuffer, is.gcount()); // support '\0' element in it
         blocks.push_back(block);
     }
 
-    delete blockbuffer;
+    delete[] blockbuffer;
     return blocks;
 }
 
-//form the file in local directory from the a list of blocks
-void SurfStoreClient::create_file_from_blocklist(string filename, list<string>& blocks){
-  auto log = logger();
-  log->info("Reconstituting file '{}'", filename);
-  std::ofstream out(base_dir + "/" + filename);
-
-  for (const string& block : blocks) { out << block; }
-
-  out.close();
-  log->info("File '{}' reconstitution successful", filename);
+// write the whole buffer to fd, retrying on short writes and EINTR
+static bool write_fully(int fd, const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) { continue; }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
 }
 
-void SurfStoreClient::create_file_from_hashlist(string filename, list<string>& hashlist){
+// Download the blocks of a file and stream them straight to disk.
+// Blocks are coalesced into a write buffer of at most write_buffer bytes and
+// written to a hidden temp file (preallocated with fallocate) next to the
+// destination, which is renamed over the destination once every block has
+// arrived. Memory use is bounded by write_buffer regardless of the file size,
+// and readers never observe a partially downloaded file.
+bool SurfStoreClient::create_file_from_hashlist(string filename, list<string>& hashlist){
     auto log = logger();
-    log->info("Getting '{}' file blocks from server", filename);
+    SS_DEBUG(log, "Getting '{}' file blocks from server", filename);
+    TraceScope ts(trace, "reconstitute", filename);
+
+    string filepath = base_dir + "/" + filename;
 
     // delete the file if needed
     if (hashlist == DELETED_HASHLIST) {
         log->info("Deleted file '{}' detected", filename);
         //delete the file if exists
-        const char * filepath = (base_dir +"/" +filename).c_str();
-
-        if (fileExists(filepath)) {
-            if(remove(filepath) == -1){
+        if (fileExists(filepath.c_str())) {
+            if(remove(filepath.c_str()) == -1){
                 log->error("remove file '{}' failed", filename);
             }
             else{
                 log->info("remove file '{}' successfully", filename);
+                prune_empty_parents(base_dir, filename);
             }
         }
-        return;
+        return true;
     }
 
+    if (!make_parent_dirs(base_dir, filename)) {
+        log->error("cannot create directories for '{}': {}", filename, strerror(errno));
+        return false;
+    }
+
+    // hidden temp file in the destination's directory (so the final rename
+    // stays within one filesystem), skipped by the directory scan in sync()
+    size_t slash = filename.rfind('/');
+    string dirpath = slash == string::npos ? base_dir : base_dir + "/" + filename.substr(0, slash);
+    string tmppath = slash == string::npos
+        ? base_dir + "/." + filename + ".sstmp"
+        : dirpath + "/." + filename.substr(slash + 1) + ".sstmp";
+    int fd = open(tmppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        log->error("cannot create temp file '{}': {}", tmppath, strerror(errno));
+        return false;
+    }
+
+    // Reserve an upper bound up front so the file is laid out contiguously;
+    // the tail is trimmed with ftruncate once the real size is known. This
+    // is only a hint: if fallocate fails for any reason (no support, or no
+    // room for the upper bound when the blocks are smaller) the file just
+    // grows as we write, and a real lack of space fails the writes.
+    off_t upper = (off_t) hashlist.size() * blocksize;
+    if (upper > 0 && fallocate(fd, 0, 0, upper) != 0) {
+        SS_DEBUG(log, "fallocate of {} bytes for '{}' failed: {}", upper, filename, strerror(errno));
+    }
+
+    string buffer;
+    buffer.reserve(write_buffer);
+    off_t written = 0;
+    bool ok = true;
+
     // download file blocks
-    list<string> blocks;
     for (const string& hash : hashlist) {
-        blocks.push_back(c->call("get_block", hash).as<string>());
+        string block = download_block(hash);
+        if (block.empty()) { // server answers "" for blocks it does not have
+            log->error("Block {} of file '{}' is missing on the server", hash, filename);
+            ok = false;
+            break;
+        }
+        if (buffer.size() + block.size() > write_buffer && !buffer.empty()) {
+            if (!write_fully(fd, buffer.data(), buffer.size())) { ok = false; break; }
+            written += buffer.size();
+            buffer.clear();
+        }
+        buffer.append(block);
+    }
+    if (ok && !buffer.empty()) {
+        ok = write_fully(fd, buffer.data(), buffer.size());
+        written += buffer.size();
+    }
+    if (ok && ftruncate(fd, written) != 0) { ok = false; }
+    // the data must be on disk before the rename makes it the file, or a
+    // crash could leave an empty or partial file under the name
+    if (ok && fsync(fd) != 0) { ok = false; }
+    if (close(fd) != 0) { ok = false; }
+
+    if (!ok || rename(tmppath.c_str(), filepath.c_str()) != 0) {
+        log->error("File '{}' reconstitution failed: {}", filename, strerror(errno));
+        unlink(tmppath.c_str());
+        return false;
+    }
+    // and the rename itself must be, before the local index records the file
+    int dirfd = open(dirpath.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dirfd < 0 || fsync(dirfd) != 0) {
+        log->warn("Cannot sync directory '{}': {}", dirpath, strerror(errno));
     }
-    create_file_from_blocklist(filename, blocks); // reconstitute the file
+    if (dirfd >= 0) { close(dirfd); }
+
+    log->info("File '{}' reconstitution successful ({} bytes)", filename, written);
+    return true;
 }
 
 void SurfStoreClient::remote2local(string remote_filename, list<string>& remote_hashlist, int remotev){
-    create_file_from_hashlist(remote_filename, remote_hashlist);
+    // leave the local index untouched if the download failed so the next
+    // sync retries it
+    if (!create_file_from_hashlist(remote_filename, remote_hashlist)) { return; }
     FileInfo new_finfo = make_tuple(remotev, remote_hashlist);
     set_local_fileinfo(remote_filename, new_finfo); // update local index
 }
 
-void SurfStoreClient::upload_data(string filename, list<string>& hashlist){
+bool SurfStoreClient::upload_data(string filename, const list<string>& hashlist, const set<string>* only){
     auto log = logger();
-    log->info("Uploading '{}' file blocks to server", filename);
+    SS_DEBUG(log, "Uploading '{}' file blocks to server", filename);
 
-    list<string> new_blocks = get_blocks_from_file(filename); // same # of entries as new_hashlist
+    // the file is read again: it may have changed since it was hashed
+    list<string> new_blocks = get_blocks_from_file(filename);
+    if (new_blocks.size() != hashlist.size()) {
+        log->warn("'{}' changed since it was scanned, committing it on the next sync", filename);
+        return false;
+    }
 
     // iterate through both new_hashlist and new_blocks simultaneously
     auto hashlist_it = hashlist.begin(); // same length as new_blocks
     auto blocks_it = new_blocks.begin(); // same length as hashlist
 
-    // store all blocks via rpc call. See https://stackoverflow.com/a/36260558
+    // up to UPLOAD_WINDOW blocks are on their way at once, so the servers
+    // (and a replication chain) work on several blocks at a time
+    Uploads inflight;
+    auto finish_upload = [&]() {
+        TraceScope ts(trace, "upload_wait");
+        RPCLIB_MSGPACK::object_handle ret = inflight.front().second.get();
+        if (ret.get().type == RPCLIB_MSGPACK::type::BOOLEAN && !ret.get().as<bool>()) {
+            SS_RATE_LIMITED(log, spdlog::level::warn, "Block {} is stored on fewer than {} block servers",
+                            inflight.front().first, block_replicas);
+        }
+        inflight.pop_front();
+    };
+
+    // Pick the blocks to send first. Blocks the server already has are
+    // skipped (repeated blocks, blocks of the previous version, the ones it
+    // did not ask for); the server never drops blocks. Of the others, the
+    // ones the server's block filter has never seen are sent right away;
+    // the ones it may have are asked about (missing_blocks), or left to
+    // the commit to check with commit_first.
+    vector<pair<const string*, const string*>> send; // hash, block
+    set<string> queued;
+    map<string, list<string>> ask;                   // by node
+    map<string, const string*> asked_blocks;
     while(hashlist_it != hashlist.end() && blocks_it != new_blocks.end()){
-        c->call("store_block", *hashlist_it, *blocks_it);
+        const string& hash = *hashlist_it;
+        if (queued.count(hash)) {
+            // a repeat of a block this call sends anyway
+        } else if ((only && !only->count(hash)) || server_blocks.count(hash)) {
+            count_dedup_hit(hash);
+        } else {
+            const CuckooFilter* filter = only ? nullptr : block_filter(hash);
+            if (filter && !filter->maybe_contains(hash)) {
+                send.push_back(make_pair(&hash, &*blocks_it));
+                queued.insert(hash);
+            } else if (commit_first && !only) {
+                // the commit reports it if it is missing
+            } else if (filter) {
+                if (asked_blocks.insert(make_pair(hash, &*blocks_it)).second) { ask[ring.owner(hash)].push_back(hash); }
+            } else {
+                send.push_back(make_pair(&hash, &*blocks_it));
+                queued.insert(hash);
+            }
+        }
+        ++hashlist_it; ++blocks_it;
+    }
+    for (const auto& kv : ask) {
+        list<string> missing;
+        {
+            TraceScope ts(trace, "missing_blocks");
+            missing = block_node(kv.first).call("missing_blocks", kv.second).as<list<string>>();
+        }
+        set<string> lacking(missing.begin(), missing.end());
+        for (const string& hash : kv.second) {
+            if (!lacking.count(hash)) { count_dedup_hit(hash); }
+        }
+        for (const string& hash : missing) {
+            auto it = asked_blocks.find(hash);
+            if (it != asked_blocks.end()) { send.push_back(make_pair(&it->first, it->second)); }
+        }
+    }
+
+    // a block stored under a hash it does not have would corrupt every
+    // file using that hash: send nothing if the file changed meanwhile
+    {
+        TraceScope ts(trace, "hash", filename);
+        for (const auto& hb : send) {
+            if (picosha2::hash256_hex_string(*hb.second) != *hb.first) {
+                log->warn("'{}' changed since it was scanned, committing it on the next sync", filename);
+                return false;
+            }
+        }
+    }
+    server_blocks.insert(queued.begin(), queued.end());
+    for (const auto& kv : ask) { server_blocks.insert(kv.second.begin(), kv.second.end()); }
+    for (const auto& hb : send) { counted_blocks.insert(*hb.first); }
+
+    // store all blocks via rpc call. See https://stackoverflow.com/a/36260558
+    for (const auto& hb : send) {
+        while (inflight.size() >= UPLOAD_WINDOW) { finish_upload(); }
+        upload_block(*hb.first, *hb.second, inflight);
 
         //testing delay
         // this_thread::sleep_for(std::chrono::milliseconds(10));
-        ++hashlist_it; ++blocks_it;
     }
+    while (!inflight.empty()) { finish_upload(); }
+    confirm_chains();
 
     log->info("Upload '{}' file complete", filename);
+    return true;
 }
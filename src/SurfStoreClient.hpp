@@ -3,12 +3,25 @@
 
 #include <string>
 #include <list>
+#include <map>
+#include <memory>
+#include <set>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <chrono>
+#include <future>
 
 #include "inih/INIReader.h"
 #include "rpc/client.h"
 
 #include "logger.hpp"
+#include "CuckooFilter.hpp"
+#include "ErasureCode.hpp"
+#include "HashRing.hpp"
 #include "SurfStoreTypes.hpp"
+#include "SyncTrace.hpp"
 
 using namespace std;
 
@@ -19,28 +32,140 @@ class SurfStoreClient
     ~SurfStoreClient();
 
     void sync(); // sync the base_dir with the cloud
+    void sync(const set<string>& paths); // sync only the given files
+    void watch(); // daemon mode: sync local changes as they happen
 
     const uint64_t RPC_TIMEOUT = 100; // milliseconds
 
+    // how long each wait_for_changes() long-poll may stay parked
+    const int WATCH_TIMEOUT_MS = 30000;
+
+    // how long to wait for a metadata replica to answer a ping, and any
+    // other call, before falling back to the primary
+    const int REPLICA_CONNECT_MS = 1000;
+    const int REPLICA_TIMEOUT_MS = 10000;
+    const int REPLICA_RETRY_S = 30; // reads skip a failed replica this long
+
+    // block uploads kept in flight at once
+    const size_t UPLOAD_WINDOW = 16;
+
+    // how long a block server may take to answer (or to accept a connection)
+    const int BLOCK_TIMEOUT_MS = 10000;
+
+    // how long the tails of the chains may take to get replicated blocks
+    const int CHAIN_ACK_MS = 10000;
+
+    // hashes (over all FileInfos) sent in one update_files() call at most
+    const size_t COMMIT_BATCH_HASHES = 65536;
+    // update_files() calls per file at most when the server reports missing blocks
+    const int COMMIT_ROUNDS = 3;
+
   protected:
     INIReader &config;
+    string serveraddr; // [ssd] server: metadata server, "host:port"
     string serverhost;
     int serverport;
     string base_dir;
     int blocksize;
+    size_t write_buffer; // bytes of downloaded blocks coalesced per write()
+    bool compression;    // [ss] compression: compress blocks if the server allows it
+    bool encoded_rpcs;   // server speaks store_encoded_block/get_encoded_block
+    int codec;           // codec used for uploads (see BlockCodec.hpp)
+    int debounce_ms;        // daemon: quiet period before a batch is synced
+    int max_batch_delay_ms; // daemon: upper bound on how long a batch waits
+    int full_sync_interval; // daemon: seconds between full syncs, 0 = never
+    int scan_threads;       // threads used to walk base_dir
+    bool sync_report;       // log a per-phase summary after each sync
+    string trace_file;      // write a Chrome trace of each sync here if set
 
     rpc::client *c;
 
-    // helper functions to get/set from the local index file
-    FileInfo get_local_fileinfo(string filename);
-    void set_local_fileinfo(string filename, FileInfo finfo);
+    // [ssd] metadata_replicas: metadata reads (get_fileinfo_map and the
+    // wait_for_changes long-poll) go to one replica picked at random,
+    // commits always to the primary; unset: everything to the primary
+    string readaddr;
+    string readhost;
+    int readport;
+    unique_ptr<rpc::client> rc;
+    chrono::steady_clock::time_point replica_retry;
+    rpc::client& replica();
+
+    // [ssd] block_servers: blocks are spread over these by consistent
+    // hashing; just the metadata server if none are configured
+    HashRing ring;
+    int block_replicas; // [ssd] block_replicas: servers storing each block
+    unsigned read_rr;   // spreads block reads over those servers
+    ErasureCode erasure; // [ssd] erasure_coding: k+m fragments per block instead
+    map<string, unique_ptr<rpc::client>> block_clients;
+    rpc::client& block_node(const string& node);
+    // block servers that failed during the current sync; reads skip them
+    set<string> down_nodes;
+    void node_failed(const string& node, const exception& e);
+    // blocks sent down a chain, by the tail that has not confirmed them yet
+    map<string, list<string>> unacked;
+    void confirm_chains();
+
+    // timing and counters of the current sync
+    SyncTrace trace;
+    // blocks known to be on the server during the current sync; not uploaded again
+    set<string> server_blocks;
+    // blocks already counted during the current sync, as dedup hits or
+    // as uploaded
+    set<string> counted_blocks;
+    void count_dedup_hit(const string& hash);
+    // cuckoo filters of the block servers' hashes (get_block_filter), by
+    // node; checked: brought up to date during the current sync
+    struct BlockFilter {
+        uint64_t version;
+        unique_ptr<CuckooFilter> filter;
+        bool checked;
+        BlockFilter() : version(0), checked(false) {}
+    };
+    map<string, BlockFilter> block_filters;
+    const CuckooFilter* block_filter(const string& hash);
+
+    void do_sync(const set<string>* only);
+    void reconnect();
+    FileInfoMap fetch_remote_index(bool from_primary = false);
+    bool commit_fileinfo(const string& filename, const FileInfo& finfo);
+    vector<CommitResult> commit_fileinfos(const FileInfoBatch& batch);
+    bool batch_commits; // server speaks update_files
+    bool commit_first;  // the server stores the blocks: commit, then upload what it is missing
+
+    // daemon: remote changes reported by the wait_for_changes() long-poll
+    // thread, handed to the main loop through wake_fd
+    void watch_remote();
+    mutex remote_mtx;
+    set<string> remote_changes;
+    int wake_fd;
+    atomic<bool> stopping;
+
+    // the local index file (index.txt), read at the start of a sync and
+    // written at its end if anything changed
+    FileInfoMap local_index;
+    bool local_index_dirty;
+    void load_local_index();
+    void save_local_index();
+    FileInfo get_local_fileinfo(const string& filename);
+    void set_local_fileinfo(const string& filename, const FileInfo& finfo);
+
+    // block transfer helpers, encoding blocks with the negotiated codec;
+    // uploads are started and queued on a Uploads, by block hash
+    typedef deque<pair<string, future<RPCLIB_MSGPACK::object_handle>>> Uploads;
+    void negotiate_codec();
+    string download_block(const string& hash);
+    string download_block_from(rpc::client& bc, const string& hash);
+    string download_fragments(const string& hash);
+    void upload_block(const string& hash, const string& block, Uploads& inflight);
+    void upload_fragments(const string& hash, const string& encoded, Uploads& inflight);
 
     // helper functions to get/set blocks to/from local files
     list<string> get_blocks_from_file(string filename);
-    void create_file_from_blocklist(string filename, list<string>& blocks);
-    void create_file_from_hashlist(string filename, list<string>& hashlist);
+    bool create_file_from_hashlist(string filename, list<string>& hashlist);
     void remote2local(string remote_filename, list<string>& remote_hashlist, int remotev);
-    void upload_data(string filename, list<string>& hashlist);
+    // uploads the blocks of the file the server lacks, or only those in `only`;
+    // false (nothing sent) if the file no longer matches hashlist
+    bool upload_data(string filename, const list<string>& hashlist, const set<string>* only = nullptr);
 };
 
 #endif // SURFSTORECLIENT_HPP
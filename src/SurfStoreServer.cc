@@ -1,21 +1,49 @@
 #include <sysexits.h>
 #include <string>
+#include <chrono>
+#include <algorithm>
+#include <memory>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <set>
 
+#include "rpc/client.h"
 #include "rpc/server.h"
+#include "rpc/this_handler.h"
 
 #include "logger.hpp"
+#include "BlockCodec.hpp"
+#include "SurfStoreStats.hpp"
 #include "SurfStoreTypes.hpp"
 #include "SurfStoreServer.hpp"
 
 using namespace std;
 
-SurfStoreServer::SurfStoreServer(INIReader &t_config)
-    : config(t_config)
+// the host:port entries of a comma separated config value
+static vector<string> address_list(const string& conf)
+{
+    vector<string> addresses;
+    stringstream ss(conf);
+    string addr;
+    while (getline(ss, addr, ',')) {
+        addr.erase(0, addr.find_first_not_of(" \t"));
+        addr.erase(addr.find_last_not_of(" \t") + 1);
+        if (!addr.empty()) { addresses.push_back(addr); }
+    }
+    return addresses;
+}
+
+const size_t SurfStoreServer::FIM_SHARDS;
+
+SurfStoreServer::SurfStoreServer(INIReader &t_config, const string& t_address)
+    : config(t_config), batches_publishing(0), batches_published(0), epoch(0), waiters(0), primary_epoch(0)
 {
     auto log = logger();
 
-    // pull the address and port for the server
-    string servconf = config.Get("ssd", "server", "");
+    // pull the address and port for the server; a block server started
+    // from the same config gets its own address on the command line
+    string servconf = t_address.empty() ? config.Get("ssd", "server", "") : t_address;
     if (servconf == "")
     {
         log->error("Server line not found in config file");
@@ -33,6 +61,297 @@ SurfStoreServer::SurfStoreServer(INIReader &t_config)
         log->error("The port provided is invalid: {}", servconf);
         exit(EX_CONFIG);
     }
+
+    // [ssd] role selects which RPCs this process serves; a server started
+    // on its own address is one of the metadata_replicas or else one of the
+    // block_servers
+    role = config.Get("ssd", "role", "all");
+    if (role != "all" && role != "metadata" && role != "block")
+    {
+        log->error("Unknown role {}, expected all, metadata or block", role);
+        exit(EX_CONFIG);
+    }
+    if (!t_address.empty() && t_address != config.Get("ssd", "server", ""))
+    {
+        vector<string> replicas = address_list(config.Get("ssd", "metadata_replicas", ""));
+        role = find(replicas.begin(), replicas.end(), t_address) != replicas.end() ? "replica" : "block";
+    }
+    serves_metadata = (role != "block");
+    serves_blocks = (role == "all" || role == "block");
+    checks_blocks = (role == "all" && address_list(config.Get("ssd", "block_servers", "")).empty());
+
+    num_threads = config.GetInteger("ssd", "threads", NUM_THREADS);
+    if (role == "block") { num_threads = config.GetInteger("ssd", "block_threads", num_threads); }
+    if (num_threads < 1)
+    {
+        log->error("The number of threads must be positive: {}", num_threads);
+        exit(EX_CONFIG);
+    }
+    // a parked wait_for_changes() call occupies a worker thread, so always
+    // keep one thread free for everything else
+    max_waiters = num_threads - 1;
+}
+
+// approximate wire size of FileInfo entries, for the bytes in/out stats
+static size_t fileinfo_bytes(const string& filename, const FileInfo& finfo)
+{
+    size_t n = filename.size() + sizeof(int);
+    for (const string& hash : get<1>(finfo)) { n += hash.size(); }
+    return n;
+}
+
+static size_t fileinfo_map_bytes(const FileInfoMap& m)
+{
+    size_t n = 0;
+    for (const auto& kv : m) { n += fileinfo_bytes(kv.first, kv.second); }
+    return n;
+}
+
+template <typename Tree>
+static size_t fileinfo_tree_bytes(const Tree& t)
+{
+    size_t n = 0;
+    t.for_each([&](const string& filename, const FileInfo& finfo) { n += fileinfo_bytes(filename, finfo); });
+    return n;
+}
+
+// Record a new FileInfo for filename and wake up parked watchers.
+// Caller must hold the lock of the file's shard (not mtx).
+void SurfStoreServer::commit_file(const string& filename, const FileInfo& finfo)
+{
+    FimShard& s = shard(filename);
+    s.tree.publish(s.tree.set(filename, finfo));
+
+    // under the shard's lock, so commits of a file get epochs in order
+    lock_guard<mutex> lock(mtx);
+    record_change(filename);
+    changed.notify_all();
+}
+
+// Give filename's latest change a new epoch. Caller must hold mtx.
+void SurfStoreServer::record_change(const string& filename)
+{
+    epoch++;
+    auto it = fim_epoch.find(filename);
+    if (it != fim_epoch.end()) {
+        changelog.erase(it->second);
+        it->second = epoch;
+    } else {
+        fim_epoch[filename] = epoch;
+    }
+    changelog[epoch] = filename;
+}
+
+/** Commit several files at once: readers see all of the batch or none of
+ * it. If checked, each FileInfo is only applied if it creates its file or
+ * its version is exactly one greater than the current one (or the one an
+ * earlier entry of the batch set), and if this server has every block it
+ * references; entries that fail are left out and the rest still commit.
+ * Returns for each entry whether it was applied, else the blocks it
+ * references that are missing. Caller must not hold mtx or any shard's
+ * lock.
+ */
+vector<CommitResult> SurfStoreServer::commit_batch(const FileInfoBatch& batch, bool checked)
+{
+    vector<CommitResult> results(batch.size(), CommitResult(false, list<string>()));
+    // blocks first, without locks: they are only ever added (but for
+    // ssrebalance, which moves them off servers that no longer own them)
+    if (checked && checks_blocks) {
+        for (size_t k = 0; k < batch.size(); k++) { get<1>(results[k]) = missing_blocks(get<1>(batch[k].second)); }
+    }
+
+    // lock the shards in index order, so batches never deadlock
+    vector<size_t> indexes;
+    for (const auto& kv : batch) { indexes.push_back(shard_index(kv.first)); }
+    vector<size_t> locked(indexes);
+    sort(locked.begin(), locked.end());
+    locked.erase(unique(locked.begin(), locked.end()), locked.end());
+    vector<unique_lock<mutex>> shard_locks;
+    map<size_t, FileInfoTree> trees; // the next version of each shard
+    for (size_t i : locked) {
+        shard_locks.emplace_back(fim[i].mtx);
+        trees[i] = fim[i].tree;
+    }
+
+    set<size_t> changed_shards;
+    for (size_t k = 0; k < batch.size(); k++) {
+        FileInfoTree& tree = trees[indexes[k]];
+        const FileInfo* current = tree.find(batch[k].first);
+        if (checked && current && get<0>(batch[k].second) != get<0>(*current) + 1) {
+            get<1>(results[k]).clear(); // a conflict, whatever blocks are missing
+            continue;
+        }
+        if (!get<1>(results[k]).empty()) { continue; }
+        tree = tree.set(batch[k].first, batch[k].second);
+        changed_shards.insert(indexes[k]);
+        get<0>(results[k]) = true;
+    }
+    if (changed_shards.empty()) { return results; }
+
+    batches_publishing++;
+    for (size_t i : changed_shards) { fim[i].tree.publish(trees[i]); }
+    batches_published++;
+    batches_publishing--;
+
+    lock_guard<mutex> lock(mtx);
+    for (size_t k = 0; k < batch.size(); k++) {
+        if (get<0>(results[k])) { record_change(batch[k].first); }
+    }
+    changed.notify_all();
+    return results;
+}
+
+// the blocks of a hash list that are not stored here, each once; a
+// tombstone references none. hdm.contains() asks the block index's cuckoo
+// filter first, so blocks never stored cost no index lookup.
+list<string> SurfStoreServer::missing_blocks(const list<string>& hashlist)
+{
+    list<string> missing;
+    if (hashlist == DELETED_HASHLIST) { return missing; }
+    set<string> seen;
+    for (const string& hash : hashlist) {
+        if (!hdm.contains(hash) && seen.insert(hash).second) { missing.push_back(hash); }
+    }
+    return missing;
+}
+
+// a snapshot of every shard; each is consistent and a batch is in it
+// whole or not at all, but single-file commits that raced with taking it
+// may be in it or not. Caller must not hold mtx: it may lock the shards.
+SurfStoreServer::FileInfoShards SurfStoreServer::fim_snapshot()
+{
+    const int ATTEMPTS = 16;
+    for (int attempt = 0; attempt < ATTEMPTS; attempt++) {
+        uint64_t published = batches_published.load();
+        if (batches_publishing.load() == 0) {
+            FileInfoShards snapshot;
+            snapshot.shards.reserve(FIM_SHARDS);
+            for (size_t i = 0; i < FIM_SHARDS; i++) { snapshot.shards.push_back(fim[i].tree.snapshot()); }
+            if (batches_publishing.load() == 0 && batches_published.load() == published) { return snapshot; }
+        }
+        this_thread::yield();
+    }
+
+    // batches keep coming: wait for them like another batch would
+    vector<unique_lock<mutex>> shard_locks;
+    FileInfoShards snapshot;
+    snapshot.shards.reserve(FIM_SHARDS);
+    for (size_t i = 0; i < FIM_SHARDS; i++) {
+        shard_locks.emplace_back(fim[i].mtx);
+        snapshot.shards.push_back(fim[i].tree);
+    }
+    return snapshot;
+}
+
+// Entries changed after epoch since, which is at most epoch.
+// Caller must hold mtx.
+FileInfoMap SurfStoreServer::changes_since(uint64_t since)
+{
+    FileInfoMap ret;
+    for (auto it = changelog.upper_bound(since); it != changelog.end(); ++it) {
+        FileInfoTree tree = shard(it->second).tree.snapshot();
+        const FileInfo* finfo = tree.find(it->second);
+        if (finfo) { ret[it->second] = *finfo; }
+    }
+    return ret;
+}
+
+// Replace the whole FileInfoMap with a snapshot of the primary's.
+// Caller must not hold mtx or any shard's lock.
+void SurfStoreServer::reset_fim(const FileInfoMap& snapshot)
+{
+    for (size_t i = 0; i < FIM_SHARDS; i++) {
+        lock_guard<mutex> shard_lock(fim[i].mtx);
+        FileInfoTree kept = fim[i].tree;
+        list<string> removed;
+        fim[i].tree.for_each([&](const string& filename, const FileInfo&) {
+            if (snapshot.count(filename) == 0) {
+                kept = kept.erase(filename);
+                removed.push_back(filename);
+            }
+        });
+        fim[i].tree.publish(kept);
+
+        lock_guard<mutex> lock(mtx);
+        for (const string& filename : removed) {
+            changelog.erase(fim_epoch[filename]);
+            fim_epoch.erase(filename);
+        }
+    }
+    for (const auto& kv : snapshot) {
+        FimShard& s = shard(kv.first);
+        lock_guard<mutex> shard_lock(s.mtx);
+        const FileInfo* finfo = s.tree.find(kv.first);
+        if (!finfo || *finfo != kv.second) { commit_file(kv.first, kv.second); }
+    }
+}
+
+/** Replica: ship the primary's FileInfoMap changes over with the same
+ * wait_for_changes() long-poll clients use and apply them locally, so the
+ * replica's own epochs and wait_for_changes() keep working for its
+ * clients. Runs on its own thread for the life of the server; each replica
+ * keeps one of the primary's worker threads parked.
+ */
+void SurfStoreServer::replicate()
+{
+    auto log = logger();
+    typedef tuple<uint64_t, FileInfoMap> Changes;
+    string primary = config.Get("ssd", "server", "");
+    size_t idx = primary.find(":");
+    string host = primary.substr(0, idx);
+    int pport = strtol(primary.substr(idx + 1).c_str(), nullptr, 0);
+
+    unique_ptr<rpc::client> pc;
+    uint64_t since = 0;
+    bool synced = false;
+    while (true) {
+        auto start = chrono::steady_clock::now();
+        Changes changes;
+        try {
+            if (!pc) {
+                pc.reset(new rpc::client(host, pport));
+                pc->set_timeout(MAX_WAIT_MS + 10000);
+            }
+            // the first call (since 0, no wait) returns every file
+            changes = pc->call("wait_for_changes", since, synced ? MAX_WAIT_MS : 0).as<Changes>();
+        } catch (exception &e) {
+            SS_RATE_LIMITED(log, spdlog::level::err, "Cannot follow primary {}: {}", primary, e.what());
+            pc.reset();
+            this_thread::sleep_for(chrono::seconds(1));
+            continue;
+        }
+
+        uint64_t new_epoch = get<0>(changes);
+        if (!synced || new_epoch < since) {
+            // first sync, or the primary restarted and sent everything
+            reset_fim(get<1>(changes));
+        } else {
+            // as one batch, so a batch of the primary stays one here
+            const FileInfoMap& changed_files = get<1>(changes);
+            if (!changed_files.empty()) {
+                commit_batch(FileInfoBatch(changed_files.begin(), changed_files.end()), false);
+            }
+        }
+        {
+            lock_guard<mutex> lock(mtx);
+            primary_epoch = new_epoch;
+        }
+        if (synced && new_epoch == since && chrono::steady_clock::now() - start < chrono::milliseconds(100)) {
+            // the primary had no worker thread to park us on; don't spin
+            this_thread::sleep_for(chrono::milliseconds(100));
+        }
+        since = new_epoch;
+        synced = true;
+    }
+}
+
+// the forwarder to another block server, for store_chain()
+ChainForwarder& SurfStoreServer::forwarder(const string& node)
+{
+    lock_guard<mutex> lock(forwarders_mtx);
+    unique_ptr<ChainForwarder>& f = forwarders[node];
+    if (!f) { f.reset(new ChainForwarder(node, FORWARD_QUEUE_BYTES)); }
+    return *f;
 }
 
 void SurfStoreServer::launch()
@@ -41,110 +360,435 @@ void SurfStoreServer::launch()
 
     log->info("Launching SurfStore server");
     log->info("Port: {}", port);
+    log->info("Role: {}", role);
+    log->info("Threads: {}", num_threads);
 
     rpc::server srv(port);
+    if (role == "replica") { thread(&SurfStoreServer::replicate, this).detach(); }
+
+    // every method is registered before serving starts, see ServerStats
+    RpcStats& get_block_stats = stats.rpc("get_block");
+    RpcStats& get_encoded_block_stats = stats.rpc("get_encoded_block");
+    RpcStats& store_block_stats = stats.rpc("store_block");
+    RpcStats& store_encoded_block_stats = stats.rpc("store_encoded_block");
+    RpcStats& store_chain_stats = stats.rpc("store_chain");
+    RpcStats& missing_blocks_stats = stats.rpc("missing_blocks");
+    RpcStats& get_block_filter_stats = stats.rpc("get_block_filter");
+    RpcStats& get_fileinfo_map_stats = stats.rpc("get_fileinfo_map");
+    RpcStats& update_file_stats = stats.rpc("update_file");
+    RpcStats& update_files_stats = stats.rpc("update_files");
+    RpcStats& wait_for_changes_stats = stats.rpc("wait_for_changes");
+    RpcStats& list_blocks_stats = stats.rpc("list_blocks");
+    RpcStats& delete_block_stats = stats.rpc("delete_block");
 
     srv.bind("ping", []() {
         auto log = logger();
-        log->info("ping()");
+        SS_DEBUG(log, "ping()");
         return;
     });
 
-    /** Get a block for a specific hash
-     * Accessing member variables inside a lambda:
-     * https://groups.google.com/a/ucsd.edu/forum/#!searchin/crs-cse124_wi19_a00-wi19/get_block|sort:date/crs-cse124_wi19_a00-wi19/pd8Z6T3bAiU/0xHPyFNgAgAJ
-     */
-    srv.bind("get_block", [&](string hash) {
+    if (serves_blocks) {
+        /** Get a block for a specific hash
+         * Accessing member variables inside a lambda:
+         * https://groups.google.com/a/ucsd.edu/forum/#!searchin/crs-cse124_wi19_a00-wi19/get_block|sort:date/crs-cse124_wi19_a00-wi19/pd8Z6T3bAiU/0xHPyFNgAgAJ
+         */
+        srv.bind("get_block", [&](string hash) {
 
-        auto log = logger();
-        log->info("get_block()");
+            auto log = logger();
+            SS_DEBUG(log, "get_block()");
+            RpcTimer timer(get_block_stats);
+            timer.bytes_in(hash.size());
+            BlockRef encoded;
+            if (!hdm.find(hash, encoded)) { // Sanity check: block with hash do not exist in hdm
+                SS_RATE_LIMITED(log, spdlog::level::err, "Block with hash {} do not exist!", hash);
+                timer.error();
+                return BlockRef();
+            }
 
-        auto it = hdm.find(hash); // map<string,string>::iterator
+            // blocks are kept encoded; clients that did not negotiate a codec
+            // get the raw bytes back, which for CODEC_NONE are the stored
+            // bytes after the tag
+            if ((uint8_t) encoded.data()[0] == CODEC_NONE) {
+                timer.bytes_out(encoded.size() - 1);
+                return encoded.tail(1);
+            }
+            string data;
+            if (!decode_block(encoded.data(), encoded.size(), data)) {
+                SS_RATE_LIMITED(log, spdlog::level::err, "Stored block with hash {} is corrupt", hash);
+                timer.error();
+                return BlockRef();
+            }
+            timer.bytes_out(data.size());
+            return BlockRef(move(data));
+        });
 
-        if (it == hdm.end()) { // Sanity check: block with hash do not exist in hdm
-            log->error("Block with hash {} do not exist!", hash);
-            return string("");
-        }
+        // Returns the codec tags this server accepts in store_encoded_block()
+        srv.bind("get_codecs", []() {
+            return supported_codecs();
+        });
 
-        return (it->second); // first: key, second: value
-    });
+        // Get a block in its stored encoding (codec tag + payload), letting the
+        // client decompress it; returns "" if the block does not exist
+        srv.bind("get_encoded_block", [&](string hash) {
+            auto log = logger();
+            SS_DEBUG(log, "get_encoded_block()");
+            RpcTimer timer(get_encoded_block_stats);
+            timer.bytes_in(hash.size());
+            BlockRef encoded;
+            if (!hdm.find(hash, encoded)) {
+                SS_RATE_LIMITED(log, spdlog::level::err, "Block with hash {} do not exist!", hash);
+                timer.error();
+                return BlockRef();
+            }
+            // sent straight from the stored buffer
+            timer.bytes_out(encoded.size());
+            return encoded;
+        });
 
-    /** Stores block b in the key-value store, indexed by hash value h
-     * It should store data into the hdm:HashDataMap field.
-     * On the server, blocks and the FileInfoMap are kept in memory.
-     * The files aren't "reconstituted" onto the server's file system at all.
-     * The BlockStore service only knows about blocks–it doesn’t know anything
-     * about how blocks relate to files.
-     * For hash collisions, we don't have to handle that case for this project.
-     */
-    srv.bind("store_block", [&](string hash, string data) {
-        auto log = logger();
-        log->info("store_block()");
+        /** Stores block b in the key-value store, indexed by hash value h
+         * It should store data into the hdm:BlockIndex field.
+         * On the server, blocks and the FileInfoMap are kept in memory.
+         * The files aren't "reconstituted" onto the server's file system at all.
+         * The BlockStore service only knows about blocks–it doesn’t know anything
+         * about how blocks relate to files.
+         * For hash collisions, we don't have to handle that case for this project.
+         */
+        srv.bind("store_block", [&](string hash, BlockRef data) {
+            auto log = logger();
+            SS_DEBUG(log, "store_block()");
+            RpcTimer timer(store_block_stats);
+            timer.bytes_in(hash.size() + data.size());
+            BlockRef encoded = data.encoded(); // shares the received bytes
 
-        // Use insert() instead of []. See https://stackoverflow.com/questions/326062/in-stl-maps-is-it-better-to-use-mapinsert-than
-        auto ret = hdm.insert(pair<string,string>(hash,data));
+            if (!hdm.insert(hash, encoded)) {
+                // already stored: identical content uploaded again
+                SS_DEBUG(log, "Block with hash {} already stored", hash);
+            }
 
-        if (ret.second == false) {
-            log->error("Fail to insert block with hash {}", hash);
-        }
+            return;
+        });
 
-        return;
-    });
+        /** Stores an already encoded block (codec tag + payload) as-is, so
+         * compressed uploads stay compressed in hdm
+         */
+        srv.bind("store_encoded_block", [&](string hash, BlockRef encoded) {
+            auto log = logger();
+            SS_DEBUG(log, "store_encoded_block()");
+            RpcTimer timer(store_encoded_block_stats);
+            timer.bytes_in(hash.size() + encoded.size());
 
-    /** Download a FileInfo Map from the server
-     * get_fileinfo_map(): Returns a map of the files stored in the SurfStore cloud service.
-     * It simply returns the map that was built previously in other functions.
-     * File blocks and the FileInfoMap are kept in the server’s memory.
-     * The files, on the server, are never “reconstituted” onto the server’s actual filesystem.
-     *  FileInfo file1;
-        get<0>(file1) = 42;
-        get<1>(file1) = {"h0", "h1", "h2"};
-
-        FileInfo file2;
-        get<0>(file2) = 20;
-        get<1>(file2) = {"h3", "h4"};
-
-        FileInfoMap fmap;
-        fmap["file1.txt"] = file1;
-        fmap["file2.dat"] = file2;
-     */
-    srv.bind("get_fileinfo_map", [&]() {
-        auto log = logger();
-        log->info("get_fileinfo_map()");
+            if (!valid_encoded_block(encoded.data(), encoded.size())) {
+                SS_RATE_LIMITED(log, spdlog::level::err, "Rejecting block with hash {}: unknown codec", hash);
+                timer.error();
+                return;
+            }
 
-        return fim;
-    });
+            if (!hdm.insert(hash, encoded)) {
+                // already stored: identical content uploaded again
+                SS_DEBUG(log, "Block with hash {} already stored", hash);
+            }
 
-    // update the FileInfo entry for a given file
-    /** update_file(): Updates the FileInfo values associated with a file stored in the cloud.
-     * This method replaces the hash list for the file with
-     * the provided hash list only if the new version number
-     * is exactly one greater than the current version number.
-     * Otherwise, and error is sent to the client telling them that the version
-     * they are trying to store is not right (likely too old).
-     */
-    srv.bind("update_file", [&](string filename, FileInfo finfo) {
-        int clientv = get<0>(finfo);
-        //find the given file's fileinfo
-        auto fimit = fim.find(filename);
-        //can't find the file in the fim
-        if (fimit == fim.end()) { // Sanity check: new entry in fim
-            log->info("Creating new entry for file {} in fim", filename);
-            fim[filename] = finfo;
+            return;
+        });
+
+        /** store_chain(): Chain replication of a block. Stores the encoded
+         * block like store_encoded_block() and queues it for the first
+         * server of chain, which gets the rest of the chain, so the block
+         * travels down the chain while this server already accepts the
+         * next ones. Returns false if the block could not be queued. The
+         * tail of the chain is the server to ask (see missing_blocks())
+         * whether the whole chain has the block.
+         */
+        srv.bind("store_chain", [&](string hash, BlockRef encoded, list<string> chain) {
+            auto log = logger();
+            SS_DEBUG(log, "store_chain()");
+            RpcTimer timer(store_chain_stats);
+            timer.bytes_in(hash.size() + encoded.size());
+
+            if (!valid_encoded_block(encoded.data(), encoded.size())) {
+                SS_RATE_LIMITED(log, spdlog::level::err, "Rejecting block with hash {}: unknown codec", hash);
+                timer.error();
+                return false;
+            }
+            hdm.insert(hash, encoded);
+            if (chain.empty()) { return true; } // the tail
+
+            string next = chain.front();
+            chain.pop_front();
+            if (!forwarder(next).push(hash, encoded, chain)) {
+                SS_RATE_LIMITED(log, spdlog::level::err, "Forward queue to {} is full, not forwarding block {}", next, hash);
+                timer.error();
+                return false;
+            }
             return true;
+        });
+
+        /** missing_blocks(): The hashes of the list that are not stored here.
+         * Clients ask the tail of a chain after store_chain() calls.
+         */
+        srv.bind("missing_blocks", [&](list<string> hashes) {
+            RpcTimer timer(missing_blocks_stats);
+            list<string> missing;
+            for (const string& hash : hashes) {
+                if (!hdm.contains(hash)) { missing.push_back(hash); }
+            }
+            return missing;
+        });
+
+        /** get_block_filter(): A cuckoo filter of the stored hashes (see
+         * CuckooFilter), as (version, words). Clients keep it and upload
+         * blocks it has never seen without asking; only the blocks it may
+         * have are checked with missing_blocks(). The reply is up to
+         * FILTER_EXPORT_MS old, which only costs a block stored meanwhile
+         * being uploaded again. A client that passes the version it has
+         * gets empty words back if that is still the current one.
+         */
+        srv.bind("get_block_filter", [&](uint64_t have) {
+            RpcTimer timer(get_block_filter_stats);
+            shared_ptr<const FilterExport> current = atomic_load(&filter_export);
+            auto now = chrono::steady_clock::now();
+            if (!current || (current->version != hdm.version() &&
+                             now - current->taken >= chrono::milliseconds(FILTER_EXPORT_MS))) {
+                auto next = make_shared<FilterExport>();
+                next->words = BlockRef(hdm.export_filter(next->version));
+                next->taken = now;
+                current = next;
+                atomic_store(&filter_export, current);
+            }
+            if (have == current->version) { return make_tuple(current->version, BlockRef()); }
+            timer.bytes_out(current->words.size());
+            return make_tuple(current->version, current->words);
+        });
+
+        /** list_blocks(): Up to limit stored block hashes, in order, starting
+         * after the hash `after` ("" for the first page). Used to move blocks
+         * between block servers when the set of servers changes.
+         */
+        srv.bind("list_blocks", [&](string after, int limit) {
+            RpcTimer timer(list_blocks_stats);
+            if (limit > MAX_LIST_BLOCKS || limit <= 0) { limit = MAX_LIST_BLOCKS; }
+            return hdm.list_after(after, limit);
+        });
+
+        /** delete_block(): Drop a block, once it has been copied to the block
+         * server that owns it now. Returns false if the block was not stored.
+         */
+        srv.bind("delete_block", [&](string hash) {
+            auto log = logger();
+            SS_DEBUG(log, "delete_block()");
+            RpcTimer timer(delete_block_stats);
+            return hdm.erase(hash);
+        });
+    }
+
+    if (serves_metadata) {
+        /** Download a FileInfo Map from the server
+         * get_fileinfo_map(): Returns a map of the files stored in the SurfStore cloud service.
+         * It simply returns the map that was built previously in other functions.
+         * File blocks and the FileInfoMap are kept in the server’s memory.
+         * The files, on the server, are never “reconstituted” onto the server’s actual filesystem.
+         *  FileInfo file1;
+            get<0>(file1) = 42;
+            get<1>(file1) = {"h0", "h1", "h2"};
+
+            FileInfo file2;
+            get<0>(file2) = 20;
+            get<1>(file2) = {"h3", "h4"};
+
+            FileInfoMap fmap;
+            fmap["file1.txt"] = file1;
+            fmap["file2.dat"] = file2;
+         */
+        srv.bind("get_fileinfo_map", [&]() {
+            auto log = logger();
+            SS_DEBUG(log, "get_fileinfo_map()");
+            RpcTimer timer(get_fileinfo_map_stats);
+
+            // a consistent version of the map without taking mtx, so
+            // update_file() never waits for readers. Clients mostly poll an
+            // unchanged map: its msgpack tree is built once per version and
+            // every reply in between shares it.
+            FileInfoShards current = fim_snapshot();
+            shared_ptr<const PackedFim> packed = atomic_load(&fim_packed);
+            if (!packed || !packed->version.same(current)) {
+                auto reply = make_shared<const PackedSnapshot>(current, fileinfo_tree_bytes(current));
+                packed = make_shared<const PackedFim>(PackedFim{current, reply});
+                atomic_store(&fim_packed, packed);
+            }
+            timer.bytes_out(packed->reply->size());
+            return packed->reply;
+        });
+
+        // update the FileInfo entry for a given file
+        /** update_file(): Updates the FileInfo values associated with a file stored in the cloud.
+         * This method replaces the hash list for the file with
+         * the provided hash list only if the new version number
+         * is exactly one greater than the current version number.
+         * Otherwise, and error is sent to the client telling them that the version
+         * they are trying to store is not right (likely too old).
+         * A server that stores the blocks itself (no block_servers) also
+         * refuses the update if any block of the hash list is not stored, so
+         * a client that died while uploading cannot publish a file nobody
+         * can download. That is an RPC error starting with
+         * MISSING_BLOCKS_ERROR, not false, so it cannot be mistaken for a
+         * version conflict; clients from before the check see it as a
+         * failed call and retry on their next sync.
+         */
+        // replicas only serve reads; their FileInfoMap follows the primary
+        if (role != "replica") {
+            srv.bind("update_file", [&](string filename, FileInfo finfo) {
+                auto log = logger();
+                RpcTimer timer(update_file_stats);
+                timer.bytes_in(fileinfo_bytes(filename, finfo));
+                // compare-and-set of this file's version; other shards
+                // commit meanwhile
+                FimShard& s = shard(filename);
+                lock_guard<mutex> shard_lock(s.mtx);
+
+                // a file whose blocks are not all here could not be downloaded
+                if (checks_blocks) {
+                    size_t missing = missing_blocks(get<1>(finfo)).size();
+                    if (missing > 0) {
+                        SS_RATE_LIMITED(log, spdlog::level::err, "Rejecting file {}: {} of its blocks are not stored",
+                                        filename, missing);
+                        timer.error();
+                        rpc::this_handler().respond_error(MISSING_BLOCKS_ERROR + ": " + to_string(missing) +
+                                                          " blocks of " + filename + " are not stored");
+                    }
+                }
+
+                int clientv = get<0>(finfo);
+                //find the given file's fileinfo
+                const FileInfo* current = s.tree.find(filename);
+                //can't find the file in the fim
+                if (!current) { // Sanity check: new entry in fim
+                    SS_DEBUG(log, "Creating new entry for file {} in fim", filename);
+                    commit_file(filename, finfo);
+                    return true;
+                }
+
+                int current_serverv = get<0>(*current); // the version
+
+                if (clientv != current_serverv + 1) { // Sanity check: the provided version has to be exactly one greater than old version
+                    // TODO: an error is sent to the client telling them that the version
+                    SS_RATE_LIMITED(log, spdlog::level::err, "The clientv {} is not exactly one larger than current_serverv {} for the file {}", clientv, current_serverv, filename);
+                    timer.error();
+                    return false; // fail
+                }
+                SS_DEBUG(log, "Update the file {} successful", filename);
+                commit_file(filename, finfo); // the line of code that actually update FileInfoMap
+                return true; // success
+            });
+
+            /** update_files(): update_file() for a batch of files in one call.
+             * Every entry is checked like update_file() checks it (in order,
+             * so a batch may hold several versions of a file); the ones that
+             * pass are committed together, so readers see all of them or
+             * none. Returns (committed, missing) for each entry: an entry
+             * that references blocks this server does not store is not
+             * committed and gets those hashes back, so clients can commit
+             * first and upload only what is missing. Servers with separate
+             * block_servers do not check blocks.
+             */
+            srv.bind("update_files", [&](FileInfoBatch batch) {
+                auto log = logger();
+                SS_DEBUG(log, "update_files() with {} files", batch.size());
+                RpcTimer timer(update_files_stats);
+                size_t bytes = 0;
+                for (const auto& kv : batch) { bytes += fileinfo_bytes(kv.first, kv.second); }
+                timer.bytes_in(bytes);
+
+                vector<CommitResult> results = commit_batch(batch, true);
+                size_t conflicts = 0;
+                for (const CommitResult& r : results) {
+                    if (!get<0>(r) && get<1>(r).empty()) { conflicts++; }
+                }
+                if (conflicts > 0) {
+                    SS_RATE_LIMITED(log, spdlog::level::err, "{} of {} files in a batch are not exactly one version ahead",
+                                    conflicts, batch.size());
+                    timer.error();
+                }
+                return results;
+            });
         }
 
-        int current_serverv = get<0>(fimit->second); // it->second: value, .first: value.version
+        /** wait_for_changes(): Long-poll for remote changes.
+         * Returns (epoch, changes) where changes holds every file whose FileInfo
+         * changed after since_epoch. If nothing changed yet, the call is parked
+         * until update_file() commits something or timeout_ms expires (then the
+         * map is empty). Clients pass the returned epoch to their next call; use
+         * timeout_ms = 0 to learn the current epoch without waiting.
+         * Each parked call holds a worker thread (rpclib cannot answer a request
+         * from another thread), so at most threads - 1 calls are parked at once;
+         * extra callers get an immediate, possibly empty, answer.
+         */
+        srv.bind("wait_for_changes", [&](uint64_t since_epoch, int timeout_ms) {
+            auto log = logger();
+            SS_DEBUG(log, "wait_for_changes()");
+            RpcTimer timer(wait_for_changes_stats);
+            unique_lock<mutex> lock(mtx);
+
+            if (since_epoch > epoch) {
+                // an epoch from the future (from before a server restart,
+                // or UINT64_MAX from a client leaving a replica): everything.
+                // Shard locks come before mtx, so the snapshot is taken
+                // without it; it holds every commit up to now_epoch.
+                uint64_t now_epoch = epoch;
+                lock.unlock();
+                FileInfoMap all = fim_snapshot().to_map();
+                timer.bytes_out(fileinfo_map_bytes(all));
+                return make_tuple(now_epoch, all);
+            }
 
-        if (clientv != current_serverv + 1) { // Sanity check: the provided version has to be exactly one greater than old version
-            // TODO: an error is sent to the client telling them that the version
-            log->error("The clientv {} is not exactly one larger than current_serverv {} for the file {}", clientv, current_serverv, filename);
-            return false; // fail
+            if (timeout_ms > MAX_WAIT_MS) { timeout_ms = MAX_WAIT_MS; }
+            if (since_epoch == epoch && timeout_ms > 0 && waiters >= max_waiters) {
+                SS_RATE_LIMITED(log, spdlog::level::warn, "Too many parked watchers ({}), answering immediately", waiters);
+            } else if (since_epoch == epoch && timeout_ms > 0) {
+                waiters++;
+                changed.wait_for(lock, chrono::milliseconds(timeout_ms),
+                                 [&]() { return epoch != since_epoch; });
+                waiters--;
+            }
+
+            FileInfoMap changes = changes_since(since_epoch);
+            timer.bytes_out(fileinfo_map_bytes(changes));
+            return make_tuple(epoch, changes);
+        });
+    }
+
+    /** get_stats(): Server metrics as a JSON document (see ssstat).
+     * Per-RPC call/error counters, bytes in/out, latency histograms and
+     * in-flight calls, plus the sizes of the metadata and block stores.
+     */
+    srv.bind("get_stats", [&]() {
+        nlohmann::json j = stats.to_json();
+        j["threads"] = num_threads;
+        j["role"] = role;
+        {
+            j["files"] = fim_snapshot().size();
+            lock_guard<mutex> lock(mtx);
+            j["blocks"] = hdm.size();
+            j["block_bytes"] = hdm.bytes();
+            j["block_filter_bytes"] = hdm.filter_bytes();
+            j["epoch"] = epoch;
+            j["parked_watchers"] = waiters;
+            if (role == "replica") { j["primary_epoch"] = primary_epoch; }
+        }
+        {
+            lock_guard<mutex> lock(forwarders_mtx);
+            size_t queued = 0;
+            uint64_t failed = 0;
+            for (auto& kv : forwarders) {
+                queued += kv.second->queued_bytes();
+                failed += kv.second->failed();
+            }
+            j["forward_queue_bytes"] = queued;
+            j["forward_failed"] = failed;
         }
-        log->info("Update the file {} successful", filename);
-        fim[filename] = finfo; // the line of code that actually update FileInfoMap
-        return true; // success
+        return j.dump();
     });
 
+    // run() turns the calling thread into a worker as well
+    srv.async_run(num_threads - 1);
     srv.run();
 }
@@ -1,26 +1,121 @@
 #ifndef SURFSTORESERVER_HPP
 #define SURFSTORESERVER_HPP
 
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <stdint.h>
+#include <vector>
+
 #include "SurfStoreTypes.hpp"
+#include "BlockIndex.hpp"
 #include "inih/INIReader.h"
 #include "logger.hpp"
+#include "SurfStoreStats.hpp"
+#include "ChainForwarder.hpp"
+#include "PackedSnapshot.hpp"
+#include "PersistentMap.hpp"
 
 using namespace std;
 
 class SurfStoreServer
 {
   public:
-    SurfStoreServer(INIReader &t_config);
+    // listens on t_address ("host:port") if given, else on [ssd] server
+    SurfStoreServer(INIReader &t_config, const string& t_address = string());
 
     void launch();
 
     const int NUM_THREADS = 8;
 
+    // longest a wait_for_changes() call may stay parked on the server
+    const int MAX_WAIT_MS = 60000;
+
+    // most hashes a single list_blocks() call returns
+    const int MAX_LIST_BLOCKS = 10000;
+
+    // encoded bytes store_chain() queues for each next server at most
+    const size_t FORWARD_QUEUE_BYTES = 64 << 20;
+
+    // how long an exported block filter is served before a newer one is taken
+    const int FILTER_EXPORT_MS = 1000;
+
+    // the FileInfoMap is split by file name into this many shards
+    static const size_t FIM_SHARDS = 64;
+    static size_t shard_index(const string& filename) { return std::hash<string>()(filename) % FIM_SHARDS; }
+
   protected:
     INIReader &config;
     int port;
-    FileInfoMap fim;
-    HashDataMap hdm;
+    string role;          // [ssd] role: all, metadata or block; or replica
+    bool serves_metadata; // binds the FileInfoMap RPCs (read-only on replicas)
+    bool serves_blocks;   // binds the block RPCs
+    bool checks_blocks;   // stores every block, so commits must reference stored ones
+    int num_threads;  // [ssd] threads: RPC worker threads
+    int max_waiters;  // parked wait_for_changes() calls allowed at once
+    // The FileInfoMap, in shards by file name. A shard's tree is published
+    // atomically: readers take tree.snapshot() without locks; update_file
+    // compares and sets a file's version under its shard's lock only, so
+    // commits to files of different shards run in parallel. update_files
+    // locks every shard of its batch, in index order.
+    typedef PersistentMap<string, FileInfo> FileInfoTree;
+    typedef PersistentMapShards<string, FileInfo> FileInfoShards;
+    struct FimShard {
+        mutex mtx; // serializes writers
+        FileInfoTree tree;
+    };
+    FimShard fim[FIM_SHARDS];
+    FimShard& shard(const string& filename) { return fim[shard_index(filename)]; }
+    FileInfoShards fim_snapshot();
+    // batches publishing their shards right now, and batches published so
+    // far: fim_snapshot() retries until it saw no batch half published
+    atomic<int> batches_publishing;
+    atomic<uint64_t> batches_published;
+    // get_fileinfo_map() reply, for one version of fim
+    struct PackedFim {
+        FileInfoShards version;
+        shared_ptr<const PackedSnapshot> reply;
+    };
+    shared_ptr<const PackedFim> fim_packed; // atomic_load / atomic_store
+    BlockIndex hdm; // lock-free lookups, see BlockIndex.hpp
+    // get_block_filter() reply: hdm's filter as of one of its versions
+    struct FilterExport {
+        uint64_t version;
+        BlockRef words;
+        chrono::steady_clock::time_point taken;
+    };
+    shared_ptr<const FilterExport> filter_export; // atomic_load / atomic_store
+    ServerStats stats;
+
+    // Change tracking for wait_for_changes(): every file a successful
+    // update_file or update_files commits bumps epoch; fim_epoch remembers
+    // the epoch of each file's last change and changelog indexes the same
+    // information by epoch.
+    uint64_t epoch;
+    map<string, uint64_t> fim_epoch;
+    map<uint64_t, string> changelog;
+    int waiters;
+
+    mutex mtx;                   // guards the change tracking; taken after a shard's
+    condition_variable changed;  // signalled whenever epoch advances
+
+    void commit_file(const string& filename, const FileInfo& finfo);
+    vector<CommitResult> commit_batch(const FileInfoBatch& batch, bool checked);
+    list<string> missing_blocks(const list<string>& hashlist);
+    void record_change(const string& filename);
+    FileInfoMap changes_since(uint64_t since);
+
+    // metadata replicas: follow the primary's changes
+    uint64_t primary_epoch; // last epoch of the primary applied here
+    void replicate();
+    void reset_fim(const FileInfoMap& snapshot);
+
+    // block servers store_chain() forwards to
+    map<string, unique_ptr<ChainForwarder>> forwarders;
+    mutex forwarders_mtx;
+    ChainForwarder& forwarder(const string& node);
 };
 
 #endif // SURFSTORESERVER_HPP
@@ -0,0 +1,162 @@
+#include "SurfStoreStats.hpp"
+
+using namespace std;
+
+LatencyHistogram::LatencyHistogram()
+    : total(0), sum(0), maxval(0)
+{
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        buckets[i] = 0;
+    }
+}
+
+int LatencyHistogram::bucket_of(uint64_t value)
+{
+    const uint64_t limit = (1ULL << MAX_BITS) - 1;
+    if (value > limit) { value = limit; }
+    if (value < (1ULL << SUB_BITS)) { return (int) value; }
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - SUB_BITS;
+    return ((shift + 1) << SUB_BITS) + (int) ((value >> shift) & ((1 << SUB_BITS) - 1));
+}
+
+// largest value that falls into bucket
+uint64_t LatencyHistogram::bucket_top(int bucket)
+{
+    if (bucket < (1 << SUB_BITS)) { return bucket; }
+    int shift = (bucket >> SUB_BITS) - 1;
+    uint64_t low = ((uint64_t) ((1 << SUB_BITS) + (bucket & ((1 << SUB_BITS) - 1)))) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+void LatencyHistogram::record(uint64_t value)
+{
+    buckets[bucket_of(value)].fetch_add(1, memory_order_relaxed);
+    total.fetch_add(1, memory_order_relaxed);
+    sum.fetch_add(value, memory_order_relaxed);
+
+    uint64_t seen = maxval.load(memory_order_relaxed);
+    while (value > seen && !maxval.compare_exchange_weak(seen, value, memory_order_relaxed)) {
+    }
+}
+
+void LatencyHistogram::merge(const LatencyHistogram &other)
+{
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        buckets[i].fetch_add(other.buckets[i].load(memory_order_relaxed), memory_order_relaxed);
+    }
+    total.fetch_add(other.total.load(memory_order_relaxed), memory_order_relaxed);
+    sum.fetch_add(other.sum.load(memory_order_relaxed), memory_order_relaxed);
+
+    uint64_t value = other.maxval.load(memory_order_relaxed);
+    uint64_t seen = maxval.load(memory_order_relaxed);
+    while (value > seen && !maxval.compare_exchange_weak(seen, value, memory_order_relaxed)) {
+    }
+}
+
+uint64_t LatencyHistogram::count() const
+{
+    return total.load(memory_order_relaxed);
+}
+
+uint64_t LatencyHistogram::max() const
+{
+    return maxval.load(memory_order_relaxed);
+}
+
+double LatencyHistogram::mean() const
+{
+    uint64_t n = count();
+    return n ? (double) sum.load(memory_order_relaxed) / n : 0.0;
+}
+
+uint64_t LatencyHistogram::percentile(double q) const
+{
+    uint64_t n = count();
+    if (n == 0) { return 0; }
+
+    uint64_t rank = (uint64_t) (q * n + 0.5);
+    if (rank < 1) { rank = 1; }
+    uint64_t seen = 0;
+    for (int i = 0; i < NUM_BUCKETS; i++) {
+        seen += buckets[i].load(memory_order_relaxed);
+        if (seen >= rank) {
+            uint64_t top = bucket_top(i);
+            return top < max() ? top : max();
+        }
+    }
+    return max();
+}
+
+nlohmann::json LatencyHistogram::to_json() const
+{
+    nlohmann::json j;
+    j["count"] = count();
+    j["mean"] = mean();
+    j["p50"] = percentile(0.50);
+    j["p90"] = percentile(0.90);
+    j["p99"] = percentile(0.99);
+    j["p999"] = percentile(0.999);
+    j["max"] = max();
+    return j;
+}
+
+RpcStats::RpcStats()
+    : calls(0), errors(0), bytes_in(0), bytes_out(0), in_flight(0)
+{
+}
+
+nlohmann::json RpcStats::to_json() const
+{
+    nlohmann::json j;
+    j["calls"] = calls.load();
+    j["errors"] = errors.load();
+    j["bytes_in"] = bytes_in.load();
+    j["bytes_out"] = bytes_out.load();
+    j["in_flight"] = in_flight.load();
+    j["latency_us"] = latency.to_json();
+    return j;
+}
+
+ServerStats::ServerStats()
+    : started(chrono::steady_clock::now())
+{
+}
+
+RpcStats &ServerStats::rpc(const string &method)
+{
+    unique_ptr<RpcStats> &slot = rpcs[method];
+    if (!slot) { slot.reset(new RpcStats()); }
+    return *slot;
+}
+
+nlohmann::json ServerStats::to_json() const
+{
+    nlohmann::json j;
+    j["uptime_s"] = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - started).count();
+
+    int64_t in_flight = 0;
+    nlohmann::json methods = nlohmann::json::object();
+    for (const auto &kv : rpcs) {
+        methods[kv.first] = kv.second->to_json();
+        in_flight += kv.second->in_flight.load();
+    }
+    j["in_flight"] = in_flight;
+    j["rpc"] = methods;
+    return j;
+}
+
+RpcTimer::RpcTimer(RpcStats &t_stats)
+    : stats(t_stats), start(chrono::steady_clock::now())
+{
+    stats.calls++;
+    stats.in_flight++;
+}
+
+RpcTimer::~RpcTimer()
+{
+    auto elapsed = chrono::steady_clock::now() - start;
+    stats.latency.record(chrono::duration_cast<chrono::microseconds>(elapsed).count());
+    stats.in_flight--;
+}
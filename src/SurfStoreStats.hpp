@@ -0,0 +1,100 @@
+#ifndef SURFSTORESTATS_HPP
+#define SURFSTORESTATS_HPP
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <string>
+#include <stdint.h>
+
+#include "json/json.hpp"
+
+using namespace std;
+
+/** Log-linear latency histogram in the style of HdrHistogram.
+ * Values below 16 get a bucket each; above that every power of two is
+ * split into 16 sub-buckets, so any recorded value is reported within
+ * ~6% of its true value. Recording is a handful of relaxed atomic adds and
+ * safe from any number of threads.
+ */
+class LatencyHistogram
+{
+  public:
+    static const int SUB_BITS = 4;
+    static const int MAX_BITS = 40; // values are clamped to 2^40 - 1
+    static const int NUM_BUCKETS = (MAX_BITS - SUB_BITS + 1) << SUB_BITS;
+
+    LatencyHistogram();
+
+    void record(uint64_t value);
+    void merge(const LatencyHistogram &other);
+
+    uint64_t count() const;
+    uint64_t max() const;
+    double mean() const;
+    uint64_t percentile(double q) const; // q in [0, 1]
+
+    // {"count", "mean", "p50", "p90", "p99", "p999", "max"}
+    nlohmann::json to_json() const;
+
+  private:
+    atomic<uint64_t> buckets[NUM_BUCKETS];
+    atomic<uint64_t> total;
+    atomic<uint64_t> sum;
+    atomic<uint64_t> maxval;
+
+    static int bucket_of(uint64_t value);
+    static uint64_t bucket_top(int bucket);
+};
+
+// Counters for one RPC method
+struct RpcStats
+{
+    atomic<uint64_t> calls;
+    atomic<uint64_t> errors;
+    atomic<uint64_t> bytes_in;  // payload bytes received (arguments)
+    atomic<uint64_t> bytes_out; // payload bytes returned
+    atomic<int64_t> in_flight;  // calls currently executing
+    LatencyHistogram latency;   // microseconds
+
+    RpcStats();
+    nlohmann::json to_json() const;
+};
+
+/** Per-method RPC statistics of a server.
+ * All methods are registered with rpc() before the server starts serving;
+ * after that the method table is read-only and only atomics are updated.
+ */
+class ServerStats
+{
+  public:
+    ServerStats();
+
+    RpcStats &rpc(const string &method);
+
+    // {"uptime_s", "in_flight", "rpc": {method: {...}}}
+    nlohmann::json to_json() const;
+
+  private:
+    chrono::steady_clock::time_point started;
+    map<string, unique_ptr<RpcStats>> rpcs;
+};
+
+// Times one RPC call and accounts it to its method's RpcStats
+class RpcTimer
+{
+  public:
+    RpcTimer(RpcStats &t_stats);
+    ~RpcTimer();
+
+    void bytes_in(size_t n) { stats.bytes_in += n; }
+    void bytes_out(size_t n) { stats.bytes_out += n; }
+    void error() { stats.errors++; }
+
+  private:
+    RpcStats &stats;
+    chrono::steady_clock::time_point start;
+};
+
+#endif // SURFSTORESTATS_HPP
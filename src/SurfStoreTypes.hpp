@@ -5,9 +5,15 @@
 #include <map>
 #include <list>
 #include <string>
+#include <utility>
+#include <vector>
 
 typedef tuple<int, list<string>> FileInfo; // tuple(version:int, hashlist:list<string>
 typedef map<string, FileInfo> FileInfoMap; // filename:string -> tuple(version:int, hashlist:list<string>)
-typedef map<string, string> HashDataMap; // hash: string -> data_block: string
+typedef vector<pair<string, FileInfo>> FileInfoBatch; // update_files(): (filename, FileInfo) in order
+typedef tuple<bool, list<string>> CommitResult; // update_files(): committed, else the hashes missing on the server (none: version conflict)
+
+const list<string> DELETED_HASHLIST = { "0" }; // hash list of a deleted file (tombstone)
+const string MISSING_BLOCKS_ERROR = "missing blocks"; // update_file(): start of the error for unstored blocks
 
 #endif // SURFSTORETYPES_HPP
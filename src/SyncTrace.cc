@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <fstream>
+#include <unistd.h>
+
+#include "json/json.hpp"
+
+#include "logger.hpp"
+#include "SyncTrace.hpp"
+
+using namespace std;
+
+static const char* COUNTER_NAMES[SyncTrace::NUM_COUNTERS] = {
+    "files_hashed", "blocks_hashed", "bytes_hashed",
+    "blocks_uploaded", "bytes_uploaded",
+    "blocks_downloaded", "bytes_downloaded",
+    "dedup_hits",
+};
+
+SyncTrace::SyncTrace()
+{
+    reset(false);
+}
+
+void SyncTrace::reset(bool t_keep_events)
+{
+    origin = clock::now();
+    keep_events = t_keep_events;
+    phases.clear();
+    events.clear();
+    child_ns.clear();
+    for (int i = 0; i < NUM_COUNTERS; i++) { counters[i] = 0; }
+}
+
+static double ms(uint64_t ns)
+{
+    return ns / 1e6;
+}
+
+void SyncTrace::log_summary() const
+{
+    auto log = logger();
+    uint64_t total = chrono::duration_cast<chrono::nanoseconds>(clock::now() - origin).count();
+
+    vector<pair<string, Phase>> sorted(phases.begin(), phases.end());
+    sort(sorted.begin(), sorted.end(), [](const pair<string, Phase>& a, const pair<string, Phase>& b) {
+        return a.second.self_ns > b.second.self_ns;
+    });
+
+    log->info("====== sync took {:.1f} ms ======", ms(total));
+    log->info("{:<18} {:>8} {:>12} {:>12}", "phase", "calls", "total_ms", "self_ms");
+    uint64_t accounted = 0;
+    for (const auto& p : sorted) {
+        log->info("{:<18} {:>8} {:>12.1f} {:>12.1f}", p.first, p.second.calls, ms(p.second.total_ns), ms(p.second.self_ns));
+        accounted += p.second.self_ns;
+    }
+    log->info("{:<18} {:>8} {:>12} {:>12.1f}", "(other)", "", "", ms(total > accounted ? total - accounted : 0));
+    log->info("hashed {} blocks / {} bytes in {} files, uploaded {} blocks / {} bytes, "
+              "downloaded {} blocks / {} bytes, {} dedup hits",
+              counters[BLOCKS_HASHED], counters[BYTES_HASHED], counters[FILES_HASHED],
+              counters[BLOCKS_UPLOADED], counters[BYTES_UPLOADED],
+              counters[BLOCKS_DOWNLOADED], counters[BYTES_DOWNLOADED], counters[DEDUP_HITS]);
+}
+
+// Chrome trace-event format: complete ("X") events plus the counters as metadata
+bool SyncTrace::write_chrome_trace(const string& path) const
+{
+    nlohmann::json trace;
+    nlohmann::json list = nlohmann::json::array();
+    int pid = getpid();
+
+    // the whole sync as the outermost event
+    Event whole;
+    whole.name = "sync";
+    whole.start_us = 0;
+    whole.dur_us = chrono::duration_cast<chrono::microseconds>(clock::now() - origin).count();
+    vector<const Event*> all(1, &whole);
+    for (const Event& e : events) { all.push_back(&e); }
+
+    for (const Event* ep : all) {
+        const Event& e = *ep;
+        nlohmann::json j;
+        j["name"] = e.name;
+        j["cat"] = "sync";
+        j["ph"] = "X";
+        j["ts"] = e.start_us;
+        j["dur"] = e.dur_us;
+        j["pid"] = pid;
+        j["tid"] = 1;
+        if (!e.detail.empty()) { j["args"]["file"] = e.detail; }
+        list.push_back(j);
+    }
+    trace["traceEvents"] = list;
+    trace["displayTimeUnit"] = "ms";
+    for (int i = 0; i < NUM_COUNTERS; i++) { trace["otherData"][COUNTER_NAMES[i]] = counters[i]; }
+
+    string tmp = path + ".new";
+    {
+        ofstream out(tmp);
+        out << trace.dump() << "\n";
+        if (!out) { return false; }
+    }
+    return rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+TraceScope::TraceScope(SyncTrace& t_trace, const char* t_name, const string& t_detail)
+    : trace(t_trace), name(t_name), start(SyncTrace::clock::now())
+{
+    if (trace.keep_events) { detail = t_detail; }
+    trace.child_ns.push_back(0);
+}
+
+TraceScope::~TraceScope()
+{
+    auto end = SyncTrace::clock::now();
+    uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(end - start).count();
+    uint64_t nested = trace.child_ns.back();
+    trace.child_ns.pop_back();
+    if (!trace.child_ns.empty()) { trace.child_ns.back() += ns; }
+
+    SyncTrace::Phase& p = trace.phases[name];
+    p.calls++;
+    p.total_ns += ns;
+    p.self_ns += ns > nested ? ns - nested : 0;
+
+    if (trace.keep_events) {
+        SyncTrace::Event e;
+        e.name = name;
+        e.detail = detail;
+        e.start_us = chrono::duration_cast<chrono::microseconds>(start - trace.origin).count();
+        e.dur_us = chrono::duration_cast<chrono::microseconds>(end - start).count();
+        trace.events.push_back(e);
+    }
+}
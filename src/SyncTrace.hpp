@@ -0,0 +1,78 @@
+#ifndef SYNCTRACE_HPP
+#define SYNCTRACE_HPP
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+/** Per-phase timing of one client sync.
+ * Phases are timed with TraceScope objects, which nest: each phase is
+ * reported with its total time and its self time (total minus the phases
+ * nested in it), so e.g. downloads done while reconstituting a file are not
+ * counted twice. Counters tally the work done. When events are enabled every
+ * scope is also kept as a Chrome trace event, viewable in chrome://tracing
+ * or Perfetto. A SyncTrace is only used from the syncing thread.
+ */
+class SyncTrace
+{
+  public:
+    enum Counter {
+        FILES_HASHED, BLOCKS_HASHED, BYTES_HASHED,
+        BLOCKS_UPLOADED, BYTES_UPLOADED,
+        BLOCKS_DOWNLOADED, BYTES_DOWNLOADED,
+        DEDUP_HITS, // blocks not uploaded because the server already has them
+        NUM_COUNTERS
+    };
+
+    SyncTrace();
+
+    // start a new sync; events are only recorded if keep_events is set
+    void reset(bool keep_events);
+    void add(Counter counter, uint64_t n = 1) { counters[counter] += n; }
+
+    void log_summary() const;
+    bool write_chrome_trace(const string& path) const;
+
+  private:
+    friend class TraceScope;
+    typedef chrono::steady_clock clock;
+
+    struct Phase {
+        uint64_t calls;
+        uint64_t total_ns;
+        uint64_t self_ns;
+    };
+    struct Event {
+        const char* name;
+        string detail;
+        int64_t start_us;
+        int64_t dur_us;
+    };
+
+    clock::time_point origin;
+    bool keep_events;
+    map<string, Phase> phases;
+    vector<Event> events;
+    vector<uint64_t> child_ns; // time spent in nested scopes, per open scope
+    uint64_t counters[NUM_COUNTERS];
+};
+
+// Times one phase of a sync; detail (e.g. the filename) only goes to the trace events
+class TraceScope
+{
+  public:
+    TraceScope(SyncTrace& t_trace, const char* t_name, const string& t_detail = string());
+    ~TraceScope();
+
+  private:
+    SyncTrace& trace;
+    const char* name;
+    string detail;
+    SyncTrace::clock::time_point start;
+};
+
+#endif // SYNCTRACE_HPP
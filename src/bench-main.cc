@@ -0,0 +1,400 @@
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <list>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sysexits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inih/INIReader.h"
+#include "json/json.hpp"
+#include "rpc/client.h"
+
+#include "logger.hpp"
+#include "SurfStoreTypes.hpp"
+#include "SurfStoreServer.hpp"
+#include "SurfStoreStats.hpp"
+
+using namespace std;
+
+/** ssbench: load generator for a running ssd.
+ * Each of `threads` workers opens its own connection and issues a random
+ * mix of store_block, get_block, update_file and get_fileinfo_map for
+ * `duration` seconds, after a preload phase that stores `preload_blocks`
+ * blocks (the get_block hit set) and `files` FileInfo entries.
+ *
+ * Options come from the [ssbench] section of the config file and can be
+ * overridden on the command line as name=value:
+ *   threads        (8)      concurrent connections
+ *   duration       (10)     seconds to measure
+ *   block_sizes    (4096)   comma separated; each block picks one at random
+ *   hit_ratio      (0.9)    fraction of get_block calls for stored blocks
+ *   mix            (store:20,get:60,update:15,map:5) relative op weights
+ *   files          (1000)   FileInfo entries per thread
+ *   hashes_per_file (4)     hash list length of those entries, which
+ *                           reference preloaded blocks (none without)
+ *   shared_files   (false)  every thread updates the same `files` entries
+ *                           instead, racing for their versions (update_file
+ *                           calls that lose count as errors)
+ *   own_shards     (false)  name each thread's entries so they fall into
+ *                           FileInfoMap shards no other thread uses (up
+ *                           to 64 threads): commits never wait for
+ *                           another thread's shard lock
+ *   preload_blocks (1000)   blocks stored before measuring
+ *   json           (false)  print results as JSON
+ */
+
+static map<string, string> overrides;
+static INIReader *bench_config;
+
+static string opt(const string &name, const string &def)
+{
+    auto it = overrides.find(name);
+    if (it != overrides.end()) { return it->second; }
+    return bench_config->Get("ssbench", name, def);
+}
+
+static long opt_int(const string &name, long def)
+{
+    return strtol(opt(name, to_string(def)).c_str(), nullptr, 0);
+}
+
+static double opt_double(const string &name, double def)
+{
+    return strtod(opt(name, to_string(def)).c_str(), nullptr);
+}
+
+enum BenchOp { OP_STORE, OP_GET, OP_UPDATE, OP_MAP, NUM_OPS };
+static const char *OP_NAMES[NUM_OPS] = { "store_block", "get_block", "update_file", "get_fileinfo_map" };
+static const char *OP_KEYS[NUM_OPS] = { "store", "get", "update", "map" };
+
+// results of one op type, summed over all workers
+struct OpResult
+{
+    LatencyHistogram latency;
+    atomic<uint64_t> errors;
+    atomic<uint64_t> bytes;
+    OpResult() : errors(0), bytes(0) {}
+};
+
+// 64 hex digit fake hashes; the server never verifies them
+static string bench_hash(const char *kind, int thread, uint64_t n)
+{
+    char buf[80];
+    snprintf(buf, sizeof(buf), "%s%04x%016llx", kind, thread & 0xffff, (unsigned long long) n);
+    string h(buf);
+    h.resize(64, '0');
+    return h;
+}
+
+struct BenchConfig
+{
+    string host;
+    int port;
+    int threads;
+    int duration;
+    vector<size_t> block_sizes;
+    double hit_ratio;
+    int weights[NUM_OPS];
+    int files;
+    int hashes_per_file;
+    bool shared_files;
+    bool own_shards;
+    int preload_blocks;
+};
+
+static string shared_file(int f)
+{
+    return "ssbench/shared/" + to_string(f);
+}
+
+// the FileInfo entries a thread commits to, unless shared_files
+static vector<string> own_files(const BenchConfig &bc, int id)
+{
+    // with own_shards, shard s belongs to thread s % owners
+    size_t owners = min((size_t) bc.threads, (size_t) SurfStoreServer::FIM_SHARDS);
+    vector<string> names;
+    for (int k = 0; (int) names.size() < bc.files; k++) {
+        string name = "ssbench/" + to_string(id) + "/" + to_string(k);
+        if (!bc.own_shards || SurfStoreServer::shard_index(name) % owners == id % owners) { names.push_back(name); }
+    }
+    return names;
+}
+
+// start line shared by main and the workers
+struct BenchStart
+{
+    atomic<int> ready;
+    atomic<bool> go;
+    chrono::steady_clock::time_point deadline; // written before go is set
+    BenchStart() : ready(0), go(false) {}
+};
+
+static void worker(const BenchConfig &bc, int id, const vector<string> &blocks,
+                   const vector<string> &stored, vector<atomic<int>> &shared_versions,
+                   OpResult *results, BenchStart &start_line)
+{
+    rpc::client c(bc.host, bc.port);
+    mt19937_64 rng(id * 7919 + 1);
+    uniform_int_distribution<int> pick_op(0, bc.weights[0] + bc.weights[1] + bc.weights[2] + bc.weights[3] - 1);
+    uniform_real_distribution<double> coin(0.0, 1.0);
+
+    // this thread's FileInfo entries and their current versions; entries
+    // left over from an earlier run against the same server are continued
+    vector<int> versions(bc.files, 0);
+    vector<string> names = own_files(bc, id);
+    // stored blocks only: servers that store the blocks reject the rest
+    list<string> hashlist;
+    for (int i = 0; i < bc.hashes_per_file && !stored.empty(); i++) {
+        hashlist.push_back(stored[(id * bc.hashes_per_file + i) % stored.size()]);
+    }
+    bool setup_ok = true;
+    try {
+        // shared entries are created by main
+        FileInfoMap fim;
+        if (!bc.shared_files) { fim = c.call("get_fileinfo_map").as<FileInfoMap>(); }
+        for (int f = 0; f < bc.files && !bc.shared_files; f++) {
+            auto it = fim.find(names[f]);
+            versions[f] = (it == fim.end() ? 0 : get<0>(it->second)) + 1;
+            c.call("update_file", names[f], make_tuple(versions[f], hashlist));
+        }
+    } catch (exception &e) {
+        logger()->error("worker {} setup failed: {}", id, e.what());
+        setup_ok = false;
+    }
+
+    start_line.ready++;
+    if (!setup_ok) { return; }
+    while (!start_line.go) { this_thread::yield(); }
+    chrono::steady_clock::time_point deadline = start_line.deadline;
+
+    uint64_t seq = 0;
+    while (chrono::steady_clock::now() < deadline) {
+        int r = pick_op(rng);
+        int op = 0;
+        while (r >= bc.weights[op]) { r -= bc.weights[op]; op++; }
+
+        auto start = chrono::steady_clock::now();
+        try {
+            switch (op) {
+            case OP_STORE: {
+                const string &block = blocks[rng() % blocks.size()];
+                c.call("store_block", bench_hash("s", id, seq++), block);
+                results[op].bytes += block.size();
+                break;
+            }
+            case OP_GET: {
+                bool hit = coin(rng) < bc.hit_ratio && !stored.empty();
+                string hash = hit ? stored[rng() % stored.size()] : bench_hash("m", id, seq++);
+                string data = c.call("get_block", hash).as<string>();
+                if (hit && data.empty()) { results[op].errors++; }
+                results[op].bytes += data.size();
+                break;
+            }
+            case OP_UPDATE: {
+                int f = rng() % bc.files;
+                if (bc.shared_files) {
+                    // only the winner of a version moves it on
+                    int v = shared_versions[f].load();
+                    bool ok = c.call("update_file", shared_file(f), FileInfo(make_tuple(v + 1, hashlist))).as<bool>();
+                    if (ok) { shared_versions[f].compare_exchange_strong(v, v + 1); } else { results[op].errors++; }
+                    break;
+                }
+                FileInfo finfo = make_tuple(versions[f] + 1, hashlist);
+                bool ok = c.call("update_file", names[f], finfo).as<bool>();
+                if (ok) { versions[f]++; } else { results[op].errors++; }
+                break;
+            }
+            case OP_MAP: {
+                FileInfoMap fim = c.call("get_fileinfo_map").as<FileInfoMap>();
+                results[op].bytes += fim.size();
+                break;
+            }
+            }
+        } catch (exception &e) {
+            results[op].errors++;
+        }
+        auto elapsed = chrono::steady_clock::now() - start;
+        results[op].latency.record(chrono::duration_cast<chrono::microseconds>(elapsed).count());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    // Handle the command-line argument
+    if (argc < 2)
+    {
+        cerr << "Usage: " << argv[0] << " [config_file] [name=value]..." << endl;
+        return EX_USAGE;
+    }
+
+    // Read in the configuration file
+    INIReader config(argv[1]);
+
+    if (config.ParseError() < 0)
+    {
+        cerr << "Error parsing config file " << argv[1] << endl;
+        return EX_CONFIG;
+    }
+    bench_config = &config;
+    for (int i = 2; i < argc; i++)
+    {
+        const char *eq = strchr(argv[i], '=');
+        if (!eq)
+        {
+            cerr << "Expected name=value, got " << argv[i] << endl;
+            return EX_USAGE;
+        }
+        overrides[string(argv[i], eq - argv[i])] = eq + 1;
+    }
+
+    initLogging(config);
+    auto log = logger();
+
+    BenchConfig bc;
+    string serverconf = config.Get("ssd", "server", "");
+    size_t idx = serverconf.find(":");
+    if (idx == string::npos)
+    {
+        log->error("Server line not found or invalid in config file");
+        return EX_CONFIG;
+    }
+    bc.host = serverconf.substr(0, idx);
+    bc.port = strtol(serverconf.substr(idx + 1).c_str(), nullptr, 0);
+    bc.threads = opt_int("threads", 8);
+    bc.duration = opt_int("duration", 10);
+    bc.hit_ratio = opt_double("hit_ratio", 0.9);
+    bc.files = opt_int("files", 1000);
+    bc.hashes_per_file = opt_int("hashes_per_file", 4);
+    bc.shared_files = opt("shared_files", "false") == "true";
+    bc.own_shards = opt("own_shards", "false") == "true";
+    bc.preload_blocks = opt_int("preload_blocks", 1000);
+
+    stringstream sizes(opt("block_sizes", "4096"));
+    string tok;
+    while (getline(sizes, tok, ',')) { bc.block_sizes.push_back(strtoul(tok.c_str(), nullptr, 0)); }
+
+    map<string, int> mix;
+    stringstream mixs(opt("mix", "store:20,get:60,update:15,map:5"));
+    while (getline(mixs, tok, ','))
+    {
+        size_t colon = tok.find(':');
+        if (colon != string::npos) { mix[tok.substr(0, colon)] = atoi(tok.substr(colon + 1).c_str()); }
+    }
+    int total_weight = 0;
+    for (int op = 0; op < NUM_OPS; op++)
+    {
+        bc.weights[op] = mix[OP_KEYS[op]] > 0 ? mix[OP_KEYS[op]] : 0;
+        total_weight += bc.weights[op];
+    }
+    if (bc.threads < 1 || bc.files < 1 || bc.block_sizes.empty() || total_weight == 0)
+    {
+        log->error("Invalid benchmark options");
+        return EX_USAGE;
+    }
+
+    // a pool of random blocks of the configured sizes
+    mt19937_64 rng(42);
+    vector<string> blocks;
+    for (int i = 0; i < 64; i++)
+    {
+        string b(bc.block_sizes[i % bc.block_sizes.size()], '\0');
+        for (char &ch : b) { ch = (char) rng(); }
+        blocks.push_back(b);
+    }
+
+    log->info("Preloading {} blocks", bc.preload_blocks);
+    vector<string> stored;
+    vector<atomic<int>> shared_versions(bc.shared_files ? bc.files : 0);
+    try
+    {
+        rpc::client c(bc.host, bc.port);
+        for (int i = 0; i < bc.preload_blocks; i++)
+        {
+            stored.push_back(bench_hash("p", 0, i));
+            c.call("store_block", stored.back(), blocks[i % blocks.size()]);
+        }
+        if (bc.shared_files)
+        {
+            FileInfoMap fim = c.call("get_fileinfo_map").as<FileInfoMap>();
+            list<string> hashlist;
+            if (!stored.empty()) { hashlist.assign(bc.hashes_per_file, stored[0]); }
+            for (int f = 0; f < bc.files; f++)
+            {
+                auto it = fim.find(shared_file(f));
+                int v = (it == fim.end() ? 0 : get<0>(it->second)) + 1;
+                c.call("update_file", shared_file(f), make_tuple(v, hashlist));
+                shared_versions[f] = v;
+            }
+        }
+    }
+    catch (exception &e)
+    {
+        log->error("Cannot reach {}: {}", serverconf, e.what());
+        shutdownLogging();
+        return EX_UNAVAILABLE;
+    }
+
+    log->info("Running {} threads for {}s", bc.threads, bc.duration);
+    OpResult results[NUM_OPS];
+    BenchStart start_line;
+    vector<thread> workers;
+    for (int t = 0; t < bc.threads; t++)
+    {
+        workers.push_back(thread([&, t]() {
+            worker(bc, t, blocks, stored, shared_versions, results, start_line);
+        }));
+    }
+    // measure only once every worker has connected and created its FileInfo entries
+    while (start_line.ready < bc.threads) { this_thread::sleep_for(chrono::milliseconds(10)); }
+    auto start = chrono::steady_clock::now();
+    start_line.deadline = start + chrono::seconds(bc.duration);
+    start_line.go = true;
+    for (thread &w : workers) { w.join(); }
+    double secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    nlohmann::json out;
+    out["threads"] = bc.threads;
+    out["seconds"] = secs;
+    uint64_t total_ops = 0;
+    for (int op = 0; op < NUM_OPS; op++)
+    {
+        nlohmann::json j = results[op].latency.to_json();
+        j["ops_per_s"] = results[op].latency.count() / secs;
+        j["errors"] = results[op].errors.load();
+        j["bytes"] = results[op].bytes.load();
+        out["ops"][OP_NAMES[op]] = j;
+        total_ops += results[op].latency.count();
+    }
+    out["total_ops_per_s"] = total_ops / secs;
+
+    if (opt("json", "false") == "true")
+    {
+        cout << out.dump(2) << endl;
+        shutdownLogging();
+        return 0;
+    }
+
+    printf("%d threads, %.1fs, %.0f ops/s total\n\n", bc.threads, secs, total_ops / secs);
+    printf("%-18s %10s %10s %9s %9s %9s %9s %9s %8s\n", "op", "count", "ops/s", "mean_us",
+           "p50_us", "p99_us", "p999_us", "max_us", "errors");
+    for (int op = 0; op < NUM_OPS; op++)
+    {
+        const LatencyHistogram &h = results[op].latency;
+        printf("%-18s %10llu %10.0f %9.1f %9llu %9llu %9llu %9llu %8llu\n", OP_NAMES[op],
+               (unsigned long long) h.count(), h.count() / secs, h.mean(),
+               (unsigned long long) h.percentile(0.50), (unsigned long long) h.percentile(0.99),
+               (unsigned long long) h.percentile(0.999), (unsigned long long) h.max(),
+               (unsigned long long) results[op].errors.load());
+    }
+
+    shutdownLogging();
+    return 0;
+}
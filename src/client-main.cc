@@ -13,9 +13,6 @@ using namespace std;
 
 int main(int argc, char **argv)
 {
-    initLogging();
-    auto log = logger();
-
     // Handle the command-line argument
     if (argc != 2)
     {
@@ -32,8 +29,18 @@ int main(int argc, char **argv)
         return EX_CONFIG;
     }
 
+    initLogging(config);
+
     SurfStoreClient ss(config);
-    ss.sync();
+    if (config.GetBoolean("ss", "daemon", false))
+    {
+        ss.watch();
+    }
+    else
+    {
+        ss.sync();
+    }
 
+    shutdownLogging();
     return 0;
 }
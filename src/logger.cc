@@ -1,12 +1,53 @@
+#include <chrono>
+
 #include "logger.hpp"
+#include "spdlog/async.h"
+
+spdlog::logger *cached_logger = nullptr;
+
+static shared_ptr<spdlog::logger> logger_handle;
+static atomic<uint32_t> rate_limit(20);
 
 void initLogging() {
-	auto err_logger = spdlog::stderr_color_mt("stderr");
-	spdlog::set_level(spdlog::level::debug);
+	logger_handle = spdlog::stderr_color_mt("stderr");
+	cached_logger = logger_handle.get();
+	spdlog::set_level(spdlog::level::info);
 	spdlog::set_pattern("[%H:%M:%S.%e] [%^%l%$] [thread %t] %v");
 }
 
-shared_ptr<spdlog::logger> logger() {
-	return spdlog::get("stderr");
+void initLogging(INIReader &config) {
+	if (config.GetBoolean("log", "async", false)) {
+		spdlog::init_thread_pool(config.GetInteger("log", "queue_size", 8192), 1);
+		logger_handle = spdlog::create_async_nb<spdlog::sinks::stderr_color_sink_mt>("stderr");
+	} else {
+		logger_handle = spdlog::stderr_color_mt("stderr");
+	}
+	cached_logger = logger_handle.get();
+	spdlog::set_level(spdlog::level::from_str(config.Get("log", "level", "info")));
+	spdlog::set_pattern("[%H:%M:%S.%e] [%^%l%$] [thread %t] %v");
+	rate_limit = config.GetInteger("log", "rate_limit", 20);
 }
 
+void shutdownLogging() {
+	spdlog::shutdown();
+}
+
+bool LogRateLimiter::allow(uint64_t &dropped) {
+	dropped = 0;
+	uint32_t limit = rate_limit.load(memory_order_relaxed);
+	if (limit == 0) { return true; }
+
+	int64_t now = chrono::duration_cast<chrono::seconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+	int64_t seen = window.load(memory_order_relaxed);
+	if (seen != now && window.compare_exchange_strong(seen, now, memory_order_relaxed)) {
+		count.store(0, memory_order_relaxed);
+	}
+
+	if (count.fetch_add(1, memory_order_relaxed) < limit) {
+		dropped = suppressed.exchange(0, memory_order_relaxed);
+		return true;
+	}
+	suppressed.fetch_add(1, memory_order_relaxed);
+	return false;
+}
@@ -1,12 +1,74 @@
 #ifndef LOGGER_HPP
 #define LOGGER_HPP
 
+#include <atomic>
+#include <stdint.h>
+
 #include "spdlog/spdlog.h"
 #include "spdlog/sinks/stdout_color_sinks.h"
+#include "inih/INIReader.h"
 
 using namespace std;
 
+// Set up the "stderr" logger. The second form reads the [log] section:
+//   async      (false)  hand records to a background thread through a ring
+//                       buffer instead of writing them on the calling thread
+//   queue_size (8192)   ring buffer slots; when full the oldest record is
+//                       dropped rather than blocking the caller
+//   level      (debug)  runtime level: trace, debug, info, warn, err, off
+//   rate_limit (20)     messages per second per SS_RATE_LIMITED call site,
+//                       0 = unlimited
 void initLogging();
-shared_ptr<spdlog::logger> logger();
+void initLogging(INIReader &config);
+
+// flush and stop the logging thread, if any
+void shutdownLogging();
+
+// The logger is created once and never replaced, so the handle is cached
+// instead of looked up in spdlog's registry (a mutex) on every call.
+extern spdlog::logger *cached_logger;
+inline spdlog::logger *logger() { return cached_logger; }
+
+// Debug records are compiled out unless built with `make DEBUG_LOG=1`;
+// use this for anything on a per-RPC or per-block path.
+#if SPDLOG_ACTIVE_LEVEL <= SPDLOG_LEVEL_DEBUG
+#define SS_DEBUG(log, ...) log->debug(__VA_ARGS__)
+#else
+// arguments are only named inside sizeof: never evaluated, but not "unused"
+template <typename... Args> int ss_log_unused(const Args &...);
+#define SS_DEBUG(log, ...) ((void) (log), (void) sizeof(ss_log_unused(__VA_ARGS__)))
+#endif
+
+/** Allows at most rate_limit records per second through one call site and
+ * counts the rest, so a flood of identical errors (say, a client asking for
+ * a missing block in a loop) cannot eat the server's CPU.
+ */
+class LogRateLimiter
+{
+  public:
+    constexpr LogRateLimiter() : window(0), count(0), suppressed(0) {}
+
+    // true if the record may be logged; dropped is set to the number of
+    // records suppressed since the last one that was let through
+    bool allow(uint64_t &dropped);
+
+  private:
+    atomic<int64_t> window; // second the current count belongs to
+    atomic<uint32_t> count;
+    atomic<uint64_t> suppressed;
+};
+
+#define SS_RATE_LIMITED(log, lvl, ...)                                                \
+    do                                                                                \
+    {                                                                                 \
+        static LogRateLimiter ss_limiter_;                                            \
+        uint64_t ss_dropped_;                                                         \
+        if (ss_limiter_.allow(ss_dropped_))                                           \
+        {                                                                             \
+            if (ss_dropped_)                                                          \
+                log->log(lvl, "({} similar messages suppressed)", ss_dropped_);       \
+            log->log(lvl, __VA_ARGS__);                                               \
+        }                                                                             \
+    } while (0)
 
 #endif // LOGGER_HPP
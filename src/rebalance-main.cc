@@ -0,0 +1,170 @@
+#include <algorithm>
+#include <iostream>
+#include <list>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <sysexits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inih/INIReader.h"
+#include "rpc/client.h"
+
+#include "BlockBuffer.hpp"
+#include "HashRing.hpp"
+
+using namespace std;
+
+static const int PAGE_SIZE = 1000;
+
+static rpc::client* connect(map<string, unique_ptr<rpc::client>>& clients, const string& node)
+{
+    unique_ptr<rpc::client>& c = clients[node];
+    if (!c) {
+        size_t colon = node.rfind(':');
+        c.reset(new rpc::client(node.substr(0, colon), strtol(node.substr(colon + 1).c_str(), nullptr, 0)));
+        c->set_timeout(30000);
+    }
+    return c.get();
+}
+
+/** ssrebalance: move blocks to the block server that owns them.
+ * After a block server was added to [ssd] block_servers, walks every block
+ * server and moves each block whose owner changed (copy to the new owner,
+ * then delete). With [ssd] block_replicas > 1 a block belongs on its whole
+ * chain, the owner and the following nodes: blocks found outside their
+ * chain are copied down the chain with store_chain. Fragments of
+ * erasure-coded blocks ("hash#i") go to the i-th node from the block's
+ * position, the node clients read them from. Clients keep working
+ * meanwhile: they look for blocks that were not moved yet on the following
+ * nodes of the ring. Servers given on the command line are being removed:
+ * all of their blocks are moved away, after which they can be shut down.
+ */
+int main(int argc, char **argv)
+{
+    // Handle the command-line argument
+    if (argc < 2)
+    {
+        cerr << "Usage: " << argv[0] << " [config_file] [--dry-run] [removed host:port]..." << endl;
+        return EX_USAGE;
+    }
+
+    bool dry_run = false;
+    vector<string> removed;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--dry-run") == 0) { dry_run = true; }
+        else { removed.push_back(argv[i]); }
+    }
+
+    // Read in the configuration file
+    INIReader config(argv[1]);
+
+    if (config.ParseError() < 0)
+    {
+        cerr << "Error parsing config file " << argv[1] << endl;
+        return EX_CONFIG;
+    }
+
+    HashRing ring(config.GetInteger("ssd", "virtual_nodes", HashRing::DEFAULT_VNODES));
+    stringstream block_servers(config.Get("ssd", "block_servers", ""));
+    string node;
+    while (getline(block_servers, node, ','))
+    {
+        node.erase(0, node.find_first_not_of(" \t"));
+        node.erase(node.find_last_not_of(" \t") + 1);
+        if (!node.empty()) { ring.add(node); }
+    }
+    if (ring.empty())
+    {
+        cerr << "No [ssd] block_servers in config file, nothing to rebalance" << endl;
+        return EX_CONFIG;
+    }
+
+    vector<string> sources = ring.nodes();
+    for (const string& r : removed)
+    {
+        ring.remove(r);
+        if (find(sources.begin(), sources.end(), r) == sources.end()) { sources.push_back(r); }
+    }
+    if (ring.empty())
+    {
+        cerr << "Cannot remove every block server" << endl;
+        return EX_USAGE;
+    }
+
+    size_t replicas = config.GetInteger("ssd", "block_replicas", 1);
+    if (replicas < 1) { replicas = 1; }
+    if (replicas > ring.nodes().size()) { replicas = ring.nodes().size(); }
+
+    map<string, unique_ptr<rpc::client>> clients;
+    unsigned long long total_moved = 0;
+    printf("%-24s %12s %12s %14s\n", "server", "blocks", "moved", "bytes moved");
+    for (const string& src : sources)
+    {
+        unsigned long long scanned = 0, moved = 0, bytes = 0;
+        try
+        {
+            rpc::client* sc = connect(clients, src);
+            string after;
+            while (true)
+            {
+                list<string> hashes = sc->call("list_blocks", after, PAGE_SIZE).as<list<string>>();
+                if (hashes.empty()) { break; }
+                after = hashes.back();
+
+                for (const string& hash : hashes)
+                {
+                    scanned++;
+                    vector<string> chain;
+                    size_t sep = hash.find('#');
+                    if (sep != string::npos) {
+                        // fragment i of an erasure-coded block belongs on
+                        // the i-th node from the block's position
+                        vector<string> nodes = ring.successors(hash.substr(0, sep));
+                        size_t i = strtoul(hash.c_str() + sep + 1, nullptr, 10);
+                        if (i >= nodes.size()) {
+                            cerr << "Fragment " << hash << " has no block server, keeping it" << endl;
+                            continue;
+                        }
+                        chain.push_back(nodes[i]);
+                    } else {
+                        chain = ring.successors(hash);
+                        chain.resize(replicas);
+                    }
+                    if (find(chain.begin(), chain.end(), src) != chain.end()) { continue; }
+                    moved++;
+                    if (dry_run) { continue; }
+
+                    // copy first, so the block is always somewhere a client looks
+                    BlockRef encoded = sc->call("get_encoded_block", hash).as<BlockRef>();
+                    if (encoded.empty()) { continue; }
+                    rpc::client* head = connect(clients, chain.front());
+                    if (chain.size() == 1) {
+                        head->call("store_encoded_block", hash, encoded);
+                    } else if (!head->call("store_chain", hash, encoded, list<string>(chain.begin() + 1, chain.end())).as<bool>()) {
+                        // keep the block here, the head could not pass it on
+                        cerr << "Copying block " << hash << " down its chain failed" << endl;
+                        continue;
+                    }
+                    sc->call("delete_block", hash);
+                    bytes += encoded.size();
+                }
+            }
+        }
+        catch (exception &e)
+        {
+            cerr << "Rebalancing " << src << " failed: " << e.what() << endl;
+            return EX_UNAVAILABLE;
+        }
+        printf("%-24s %12llu %12llu %14llu\n", src.c_str(), scanned, moved, bytes);
+        total_moved += moved;
+    }
+    printf("%s %llu blocks\n", dry_run ? "would move" : "moved", total_moved);
+
+    return 0;
+}
@@ -13,13 +13,11 @@ using namespace std;
 
 int main(int argc, char **argv)
 {
-    initLogging();
-    auto log = logger();
-
     // Handle the command-line argument
-    if (argc != 2)
+    // an optional listen address lets several block servers share a config
+    if (argc != 2 && argc != 3)
     {
-        cerr << "Usage: " << argv[0] << " [config_file]" << endl;
+        cerr << "Usage: " << argv[0] << " [config_file] [host:port]" << endl;
         return EX_USAGE;
     }
 
@@ -32,10 +30,13 @@ int main(int argc, char **argv)
         return EX_CONFIG;
     }
 
+    initLogging(config);
+    auto log = logger();
+
     if (config.GetBoolean("ssd", "enabled", true))
     {
         log->info("Surfstore server enabled");
-        SurfStoreServer *ssd = new SurfStoreServer(config);
+        SurfStoreServer *ssd = new SurfStoreServer(config, argc == 3 ? argv[2] : "");
         ssd->launch();
     }
     else
@@ -43,5 +44,6 @@ int main(int argc, char **argv)
         log->info("SurfStore server disabled");
     }
 
+    shutdownLogging();
     return 0;
 }
@@ -0,0 +1,99 @@
+#include <iostream>
+#include <string>
+#include <sysexits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "inih/INIReader.h"
+#include "json/json.hpp"
+#include "rpc/client.h"
+
+using namespace std;
+
+// ssstat: print the metrics of a running ssd, as a table or raw JSON
+int main(int argc, char **argv)
+{
+    // Handle the command-line argument: the server defaults to [ssd] server,
+    // block servers are given by address
+    bool as_json = false;
+    bool bad_args = (argc < 2);
+    string address;
+    for (int i = 2; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--json") == 0) { as_json = true; }
+        else if (address.empty()) { address = argv[i]; }
+        else { bad_args = true; }
+    }
+    if (bad_args)
+    {
+        cerr << "Usage: " << argv[0] << " [config_file] [host:port] [--json]" << endl;
+        return EX_USAGE;
+    }
+
+    // Read in the configuration file
+    INIReader config(argv[1]);
+
+    if (config.ParseError() < 0)
+    {
+        cerr << "Error parsing config file " << argv[1] << endl;
+        return EX_CONFIG;
+    }
+
+    string serverconf = address.empty() ? config.Get("ssd", "server", "") : address;
+    size_t idx = serverconf.find(":");
+    if (idx == string::npos)
+    {
+        cerr << "Server line not found or invalid in config file" << endl;
+        return EX_CONFIG;
+    }
+    string host = serverconf.substr(0, idx);
+    int port = strtol(serverconf.substr(idx + 1).c_str(), nullptr, 0);
+
+    string dump;
+    try
+    {
+        rpc::client c(host, port);
+        c.set_timeout(5000);
+        dump = c.call("get_stats").as<string>();
+    }
+    catch (exception &e)
+    {
+        cerr << "Cannot get stats from " << serverconf << ": " << e.what() << endl;
+        return EX_UNAVAILABLE;
+    }
+
+    nlohmann::json stats = nlohmann::json::parse(dump);
+    if (as_json)
+    {
+        cout << stats.dump(2) << endl;
+        return 0;
+    }
+
+    printf("server %s  role %s  uptime %llds  threads %d  in-flight %lld  parked watchers %d\n",
+           serverconf.c_str(), stats.value("role", string("all")).c_str(),
+           stats["uptime_s"].get<long long>(), stats["threads"].get<int>(),
+           stats["in_flight"].get<long long>(), stats["parked_watchers"].get<int>());
+    printf("files %llu  blocks %llu  block bytes %llu  filter bytes %llu  epoch %llu\n",
+           stats["files"].get<unsigned long long>(), stats["blocks"].get<unsigned long long>(),
+           stats["block_bytes"].get<unsigned long long>(), stats.value("block_filter_bytes", 0ULL),
+           stats["epoch"].get<unsigned long long>());
+    printf("chain forwarding: queued bytes %llu  failed blocks %llu\n\n",
+           stats.value("forward_queue_bytes", 0ULL), stats.value("forward_failed", 0ULL));
+
+    printf("%-20s %10s %8s %6s %12s %12s %9s %9s %9s %9s %9s\n", "method", "calls", "errors",
+           "active", "bytes_in", "bytes_out", "mean_us", "p50_us", "p99_us", "p999_us", "max_us");
+    for (auto it = stats["rpc"].begin(); it != stats["rpc"].end(); ++it)
+    {
+        const nlohmann::json &m = it.value();
+        const nlohmann::json &lat = m["latency_us"];
+        printf("%-20s %10llu %8llu %6lld %12llu %12llu %9.1f %9llu %9llu %9llu %9llu\n",
+               it.key().c_str(), m["calls"].get<unsigned long long>(), m["errors"].get<unsigned long long>(),
+               m["in_flight"].get<long long>(), m["bytes_in"].get<unsigned long long>(),
+               m["bytes_out"].get<unsigned long long>(), lat["mean"].get<double>(),
+               lat["p50"].get<unsigned long long>(), lat["p99"].get<unsigned long long>(),
+               lat["p999"].get<unsigned long long>(), lat["max"].get<unsigned long long>());
+    }
+
+    return 0;
+}
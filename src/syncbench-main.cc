@@ -0,0 +1,563 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <sysexits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <math.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "inih/INIReader.h"
+#include "json/json.hpp"
+#include "rpc/client.h"
+
+#include "logger.hpp"
+#include "DirWalker.hpp"
+#include "SurfStoreClient.hpp"
+
+using namespace std;
+
+/** sssyncbench: end-to-end sync benchmarks.
+ * For each workload a fresh ssd is spawned on the [ssd] server port, a
+ * dataset is generated under workdir/<workload>/a and full
+ * SurfStoreClient::sync() runs are timed as the data moves to other client
+ * directories. At the end of a workload the client trees are compared and
+ * the server's get_stats snapshot is recorded. Results are written as JSON.
+ *
+ * Workloads (all by default):
+ *   tiny       many small files in subdirectories; upload, download, no-op
+ *              sync, then 1% of the files modified
+ *   large      a few multi-GB files; upload, download, no-op sync
+ *   append     append-only logs growing every round
+ *   edit       large files overwritten in the middle every round
+ *   rename     every file renamed after the initial sync
+ *   contention several clients rewriting the same files and syncing at once
+ *
+ * Options come from the [syncbench] section of the config file and can be
+ * overridden on the command line as name=value:
+ *   workloads        (tiny,large,append,edit,rename,contention)
+ *   ssd              (./ssd)               server binary to spawn
+ *   workdir          (/tmp/sssyncbench)    wiped and recreated per workload
+ *   output           (-)                   JSON results, - for stdout
+ *   scale            (1.0)                 multiplies every count and size
+ *   tiny_files       (100000)  tiny_size (1024)
+ *   large_files      (3)       large_size_mb (2048)
+ *   log_files        (16)      log_size_mb (64)    append_kb (256)
+ *   edit_files       (2)       edit_size_mb (1024) edit_bytes (4096)
+ *   rename_files     (10000)   rename_size (65536)
+ *   clients          (8)       contention_files (100) contention_size (65536)
+ *                                          (clients is not scaled)
+ *   rounds           (5)                   rounds of append, edit, contention
+ */
+
+static map<string, string> overrides;
+static INIReader *bench_config;
+
+static string opt(const string &name, const string &def)
+{
+    auto it = overrides.find(name);
+    if (it != overrides.end()) { return it->second; }
+    return bench_config->Get("syncbench", name, def);
+}
+
+static double scale = 1.0;
+
+static long opt_int(const string &name, long def)
+{
+    return strtol(opt(name, to_string(def)).c_str(), nullptr, 0);
+}
+
+// a count or size option multiplied by scale, at least 1
+static uint64_t opt_scaled(const string &name, long def)
+{
+    long long v = llround(opt_int(name, def) * scale);
+    return v < 1 ? 1 : (uint64_t) v;
+}
+
+static double seconds_since(chrono::steady_clock::time_point start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+/* ---- dataset generation ---- */
+
+// xorshift64*: one step per 8 bytes, including a partial last word, so
+// short calls in a row still give different bytes
+static void fill_random(char *buf, size_t len, uint64_t &state)
+{
+    for (size_t i = 0; i < len; i += 8) {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        uint64_t v = state * 2685821657736338717ULL;
+        memcpy(buf + i, &v, min(len - i, (size_t) 8));
+    }
+}
+
+static void make_dirs(const string &path)
+{
+    for (size_t pos = path.find('/', 1); ; pos = path.find('/', pos + 1)) {
+        mkdir(path.substr(0, pos).c_str(), 0755);
+        if (pos == string::npos) { break; }
+    }
+}
+
+static int remove_entry(const char *path, const struct stat *, int, struct FTW *)
+{
+    remove(path);
+    return 0;
+}
+
+static void remove_tree(const string &path)
+{
+    nftw(path.c_str(), remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+// write len random bytes at offset (or append if offset < 0)
+static void write_random(const string &path, off_t offset, uint64_t len, uint64_t &state)
+{
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | (offset < 0 ? O_APPEND : 0);
+    int fd = open(path.c_str(), flags, 0644);
+    if (fd < 0) {
+        logger()->error("cannot open {}: {}", path, strerror(errno));
+        return;
+    }
+    if (offset >= 0) { lseek(fd, offset, SEEK_SET); }
+
+    vector<char> buf(1 << 20);
+    while (len > 0) {
+        size_t n = len < buf.size() ? len : buf.size();
+        fill_random(buf.data(), n, state);
+        if (write(fd, buf.data(), n) != (ssize_t) n) {
+            logger()->error("cannot write {}: {}", path, strerror(errno));
+            break;
+        }
+        len -= n;
+    }
+    close(fd);
+}
+
+static bool same_file(const string &a, const string &b)
+{
+    ifstream fa(a, ios::binary), fb(b, ios::binary);
+    if (!fa || !fb) { return false; }
+    vector<char> ba(1 << 20), bb(1 << 20);
+    while (fa && fb) {
+        fa.read(ba.data(), ba.size());
+        fb.read(bb.data(), bb.size());
+        if (fa.gcount() != fb.gcount() || memcmp(ba.data(), bb.data(), fa.gcount()) != 0) { return false; }
+    }
+    return !fa && !fb;
+}
+
+// true if both trees hold the same synced files with the same contents
+static bool same_tree(const string &a, const string &b)
+{
+    vector<string> fa = walk_tree(a, 4), fb = walk_tree(b, 4);
+    if (fa != fb) { return false; }
+    for (const string &f : fa) {
+        if (f != "index.txt" && !same_file(a + "/" + f, b + "/" + f)) { return false; }
+    }
+    return true;
+}
+
+/* ---- server ---- */
+
+class BenchServer
+{
+  public:
+    BenchServer(const string &t_host, int t_port) : host(t_host), port(t_port), pid(-1) {}
+    ~BenchServer() { stop(); }
+
+    bool start(const string &ssd, const string &dir)
+    {
+        string conf = dir + "/ssd.ini";
+        ofstream(conf) << "[ssd]\nserver=" << host << ":" << port << "\n[log]\nlevel=warn\n";
+
+        pid = fork();
+        if (pid == 0) {
+            int fd = open((dir + "/ssd.log").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            if (fd >= 0) { dup2(fd, 1); dup2(fd, 2); }
+            execl(ssd.c_str(), ssd.c_str(), conf.c_str(), (char *) nullptr);
+            _exit(127);
+        }
+        if (pid < 0) { return false; }
+
+        // wait until it answers ping
+        auto start = chrono::steady_clock::now();
+        while (seconds_since(start) < 10) {
+            if (waitpid(pid, nullptr, WNOHANG) == pid) {
+                pid = -1;
+                return false;
+            }
+            try {
+                rpc::client c(host, port);
+                c.set_timeout(500);
+                c.call("ping");
+                return true;
+            } catch (exception &e) {
+                this_thread::sleep_for(chrono::milliseconds(50));
+            }
+        }
+        stop();
+        return false;
+    }
+
+    void stop()
+    {
+        if (pid > 0) {
+            kill(pid, SIGTERM);
+            waitpid(pid, nullptr, 0);
+            pid = -1;
+        }
+    }
+
+    nlohmann::json stats()
+    {
+        try {
+            rpc::client c(host, port);
+            c.set_timeout(5000);
+            return nlohmann::json::parse(c.call("get_stats").as<string>());
+        } catch (exception &e) {
+            return nlohmann::json();
+        }
+    }
+
+  private:
+    string host;
+    int port;
+    pid_t pid;
+};
+
+/* ---- workloads ---- */
+
+class Workload
+{
+  public:
+    Workload(const string &t_name, const string &t_dir, const string &t_server, int t_blocksize)
+        : name(t_name), dir(t_dir), server(t_server), blocksize(t_blocksize),
+          steps(nlohmann::json::array())
+    {
+    }
+
+    // base directory of a client, created with its config on first use
+    string client(const string &id)
+    {
+        string base = dir + "/" + id;
+        if (configs.count(id) == 0) {
+            make_dirs(base);
+            string conf = dir + "/" + id + ".ini";
+            ofstream(conf) << "[ss]\nbase_dir=" << base << "\nblocksize=" << blocksize
+                           << "\n[ssd]\nserver=" << server << "\n";
+            configs[id].reset(new INIReader(conf));
+        }
+        return base;
+    }
+
+    // time one full sync of a client and record it
+    double sync(const string &step, int round, const string &id, uint64_t files, uint64_t bytes)
+    {
+        client(id);
+        SurfStoreClient ss(*configs[id]);
+        auto start = chrono::steady_clock::now();
+        ss.sync();
+        double secs = seconds_since(start);
+        record(step, round, id, secs, files, bytes);
+        return secs;
+    }
+
+    // time a concurrent sync of several clients, recorded as one step
+    double sync_all(const string &step, int round, const vector<string> &ids, uint64_t files, uint64_t bytes)
+    {
+        vector<unique_ptr<SurfStoreClient>> clients;
+        for (const string &id : ids) {
+            client(id);
+            clients.emplace_back(new SurfStoreClient(*configs[id]));
+        }
+        vector<thread> threads;
+        auto start = chrono::steady_clock::now();
+        for (auto &ss : clients) {
+            SurfStoreClient *p = ss.get();
+            threads.push_back(thread([p]() { p->sync(); }));
+        }
+        for (thread &t : threads) { t.join(); }
+        double secs = seconds_since(start);
+        record(step, round, "all", secs, files, bytes);
+        return secs;
+    }
+
+    string name;
+    string dir;
+
+    nlohmann::json result(bool consistent, const nlohmann::json &server_stats) const
+    {
+        nlohmann::json j;
+        j["name"] = name;
+        j["steps"] = steps;
+        j["consistent"] = consistent;
+        j["server"] = server_stats;
+        return j;
+    }
+
+  private:
+    string server;
+    int blocksize;
+    nlohmann::json steps;
+    map<string, unique_ptr<INIReader>> configs;
+
+    void record(const string &step, int round, const string &id, double secs, uint64_t files, uint64_t bytes)
+    {
+        nlohmann::json j;
+        j["step"] = step;
+        j["round"] = round;
+        j["client"] = id;
+        j["seconds"] = secs;
+        j["files"] = files;
+        j["bytes"] = bytes;
+        steps.push_back(j);
+        fprintf(stderr, "%-10s %-12s %3d %-4s %10.3fs %8llu files %12llu bytes\n", name.c_str(),
+                step.c_str(), round, id.c_str(), secs, (unsigned long long) files, (unsigned long long) bytes);
+    }
+};
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+
+// upload from a, download to b, then a sync with nothing to do
+static void initial_sync(Workload &w, uint64_t files, uint64_t bytes)
+{
+    w.sync("upload", 0, "a", files, bytes);
+    w.sync("download", 0, "b", files, bytes);
+    w.sync("noop", 0, "a", 0, 0);
+}
+
+static bool run_tiny(Workload &w)
+{
+    uint64_t n = opt_scaled("tiny_files", 100000), size = opt_scaled("tiny_size", 1024);
+    string a = w.client("a");
+    vector<string> names;
+    for (uint64_t i = 0; i < n; i++) {
+        char rel[64];
+        snprintf(rel, sizeof(rel), "d%04llu/f%06llu", (unsigned long long) (i / 1000), (unsigned long long) i);
+        if (i % 1000 == 0) { make_dirs(a + "/" + string(rel, 5)); }
+        names.push_back(rel);
+        write_random(a + "/" + rel, 0, size, rng_state);
+    }
+    initial_sync(w, n, n * size);
+
+    uint64_t changed = 0;
+    for (uint64_t i = 0; i < n; i += 100, changed++) { write_random(a + "/" + names[i], 0, size, rng_state); }
+    w.sync("modify_1pct", 1, "a", changed, changed * size);
+    w.sync("download", 1, "b", changed, changed * size);
+    return same_tree(a, w.client("b"));
+}
+
+static bool run_large(Workload &w)
+{
+    uint64_t n = opt_scaled("large_files", 3), size = opt_scaled("large_size_mb", 2048) << 20;
+    string a = w.client("a");
+    for (uint64_t i = 0; i < n; i++) { write_random(a + "/large" + to_string(i), 0, size, rng_state); }
+    initial_sync(w, n, n * size);
+    return same_tree(a, w.client("b"));
+}
+
+static bool run_append(Workload &w)
+{
+    uint64_t n = opt_scaled("log_files", 16), size = opt_scaled("log_size_mb", 64) << 20;
+    uint64_t append = opt_scaled("append_kb", 256) << 10;
+    int rounds = opt_int("rounds", 5);
+    string a = w.client("a");
+    for (uint64_t i = 0; i < n; i++) { write_random(a + "/log" + to_string(i), 0, size, rng_state); }
+    initial_sync(w, n, n * size);
+
+    for (int r = 1; r <= rounds; r++) {
+        for (uint64_t i = 0; i < n; i++) { write_random(a + "/log" + to_string(i), -1, append, rng_state); }
+        w.sync("append", r, "a", n, n * append);
+        w.sync("download", r, "b", n, n * append);
+    }
+    return same_tree(a, w.client("b"));
+}
+
+static bool run_edit(Workload &w)
+{
+    uint64_t n = opt_scaled("edit_files", 2), size = opt_scaled("edit_size_mb", 1024) << 20;
+    uint64_t edit = opt_scaled("edit_bytes", 4096);
+    int rounds = opt_int("rounds", 5);
+    string a = w.client("a");
+    for (uint64_t i = 0; i < n; i++) { write_random(a + "/data" + to_string(i), 0, size, rng_state); }
+    initial_sync(w, n, n * size);
+
+    for (int r = 1; r <= rounds; r++) {
+        // each round edits a different spot around the middle
+        off_t offset = size / 2 + (off_t) r * 7919 % (size / 4 + 1);
+        for (uint64_t i = 0; i < n; i++) { write_random(a + "/data" + to_string(i), offset, edit, rng_state); }
+        w.sync("edit", r, "a", n, n * edit);
+        w.sync("download", r, "b", n, n * edit);
+    }
+    return same_tree(a, w.client("b"));
+}
+
+static bool run_rename(Workload &w)
+{
+    uint64_t n = opt_scaled("rename_files", 10000), size = opt_scaled("rename_size", 65536);
+    string a = w.client("a");
+    for (uint64_t i = 0; i < n; i++) { write_random(a + "/file" + to_string(i), 0, size, rng_state); }
+    initial_sync(w, n, n * size);
+
+    for (uint64_t i = 0; i < n; i++) {
+        rename((a + "/file" + to_string(i)).c_str(), (a + "/renamed" + to_string(i)).c_str());
+    }
+    w.sync("rename", 1, "a", n, n * size);
+    w.sync("download", 1, "b", n, n * size);
+    return same_tree(a, w.client("b"));
+}
+
+static bool run_contention(Workload &w)
+{
+    long clients = opt_int("clients", 8); // not scaled
+    uint64_t nclients = clients < 2 ? 2 : clients, n = opt_scaled("contention_files", 100);
+    uint64_t size = opt_scaled("contention_size", 65536);
+    int rounds = opt_int("rounds", 5);
+    vector<string> ids;
+    for (uint64_t c = 0; c < nclients; c++) { ids.push_back("c" + to_string(c)); }
+
+    string first = w.client(ids[0]);
+    for (uint64_t i = 0; i < n; i++) { write_random(first + "/shared" + to_string(i), 0, size, rng_state); }
+    w.sync("upload", 0, ids[0], n, n * size);
+    w.sync_all("download", 0, ids, n, n * size * (nclients - 1));
+
+    for (int r = 1; r <= rounds; r++) {
+        // every client rewrites every file; one version of each wins
+        for (const string &id : ids) {
+            string base = w.client(id);
+            for (uint64_t i = 0; i < n; i++) { write_random(base + "/shared" + to_string(i), 0, size, rng_state); }
+        }
+        w.sync_all("contend", r, ids, n * nclients, n * size * nclients);
+    }
+    w.sync_all("settle", rounds + 1, ids, 0, 0);
+
+    bool consistent = true;
+    for (size_t c = 1; c < ids.size(); c++) { consistent = consistent && same_tree(first, w.client(ids[c])); }
+    return consistent;
+}
+
+int main(int argc, char **argv)
+{
+    // Handle the command-line argument
+    if (argc < 2)
+    {
+        cerr << "Usage: " << argv[0] << " [config_file] [name=value]..." << endl;
+        return EX_USAGE;
+    }
+
+    // Read in the configuration file
+    INIReader config(argv[1]);
+
+    if (config.ParseError() < 0)
+    {
+        cerr << "Error parsing config file " << argv[1] << endl;
+        return EX_CONFIG;
+    }
+    bench_config = &config;
+    for (int i = 2; i < argc; i++)
+    {
+        const char *eq = strchr(argv[i], '=');
+        if (!eq)
+        {
+            cerr << "Expected name=value, got " << argv[i] << endl;
+            return EX_USAGE;
+        }
+        overrides[string(argv[i], eq - argv[i])] = eq + 1;
+    }
+
+    initLogging(config);
+    auto log = logger();
+    // the client logs every file at info level; keep that out of the timings
+    if (config.Get("log", "level", "").empty()) { log->set_level(spdlog::level::warn); }
+
+    string serverconf = config.Get("ssd", "server", "");
+    size_t idx = serverconf.find(":");
+    if (idx == string::npos)
+    {
+        log->error("Server line not found or invalid in config file");
+        return EX_CONFIG;
+    }
+    string host = serverconf.substr(0, idx);
+    int port = strtol(serverconf.substr(idx + 1).c_str(), nullptr, 0);
+    int blocksize = config.GetInteger("ss", "blocksize", 4096);
+
+    scale = strtod(opt("scale", "1.0").c_str(), nullptr);
+    string ssd = opt("ssd", "./ssd");
+    string workdir = opt("workdir", "/tmp/sssyncbench");
+    string output = opt("output", "-");
+
+    map<string, bool (*)(Workload &)> runners = {
+        { "tiny", run_tiny }, { "large", run_large }, { "append", run_append },
+        { "edit", run_edit }, { "rename", run_rename }, { "contention", run_contention },
+    };
+
+    nlohmann::json results;
+    results["scale"] = scale;
+    results["blocksize"] = blocksize;
+    results["workloads"] = nlohmann::json::array();
+
+    stringstream workloads(opt("workloads", "tiny,large,append,edit,rename,contention"));
+    string name;
+    bool all_consistent = true;
+    while (getline(workloads, name, ','))
+    {
+        if (runners.count(name) == 0)
+        {
+            log->error("Unknown workload {}", name);
+            return EX_USAGE;
+        }
+
+        string dir = workdir + "/" + name;
+        remove_tree(dir);
+        make_dirs(dir);
+
+        BenchServer server(host, port);
+        if (!server.start(ssd, dir))
+        {
+            log->error("Cannot start {} on port {}, see {}/ssd.log", ssd, port, dir);
+            return EX_UNAVAILABLE;
+        }
+
+        Workload w(name, dir, serverconf, blocksize);
+        auto start = chrono::steady_clock::now();
+        bool consistent = runners[name](w);
+        nlohmann::json j = w.result(consistent, server.stats());
+        j["total_seconds"] = seconds_since(start);
+        results["workloads"].push_back(j);
+        server.stop();
+
+        if (!consistent) { log->error("Workload {}: client directories differ after sync", name); }
+        all_consistent = all_consistent && consistent;
+    }
+
+    if (output == "-")
+    {
+        cout << results.dump(2) << endl;
+    }
+    else
+    {
+        ofstream(output) << results.dump(2) << endl;
+    }
+
+    shutdownLogging();
+    return all_consistent ? 0 : 1;
+}